@@ -0,0 +1,141 @@
+#include <chrono>
+#include <iterator>
+#include "brick_cache.h"
+
+VolumeBrick::VolumeBrick() : mappingOffset(0), levelSpacing(1.f) {}
+const char* VolumeBrick::voxels() const {
+  return mapping ? mapping->data() + mappingOffset : data.data();
+}
+size_t VolumeBrick::voxelBytes() const {
+  return mapping ? localDims.x * localDims.y * localDims.z * voxel_size(voxelType)
+    : data.size();
+}
+
+// Copy everything about the brick except its data
+std::shared_ptr<VolumeBrick> copy_brick_info(const VolumeBrick &brick) {
+  auto info = std::make_shared<VolumeBrick>();
+  info->voxelType = brick.voxelType;
+  info->fullDims = brick.fullDims;
+  info->localDims = brick.localDims;
+  info->localOffset = brick.localOffset;
+  info->stride = brick.stride;
+  info->resolution = brick.resolution;
+  info->maxResolution = brick.maxResolution;
+  info->levelSpacing = brick.levelSpacing;
+  info->localRegion = brick.localRegion;
+  info->valueRange = brick.valueRange;
+  info->voxelRange = brick.voxelRange;
+  info->histogram = brick.histogram;
+  info->macrocells = brick.macrocells;
+  return info;
+}
+
+BrickCache::BrickCache(const size_t budget, const bool compress)
+  : budget(budget), used(0), hits(0), misses(0), compress(compress),
+  rawBytes(0), decompressTime(0)
+{}
+std::shared_ptr<VolumeBrick> BrickCache::find(const size_t timestep,
+    const std::string &variable, const int coarsenLevels)
+{
+  Cached cached;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto e = entries.find(Key(timestep, variable, coarsenLevels));
+    if (e == entries.end()) {
+      return nullptr;
+    }
+    lru.splice(lru.begin(), lru, e->second);
+    cached = e->second->second;
+  }
+  if (!cached.compressed) {
+    return cached.brick;
+  }
+
+  // Decompress outside the lock so the other thread can use the cache
+  using namespace std::chrono;
+  auto start = high_resolution_clock::now();
+  auto brick = copy_brick_info(*cached.brick);
+  brick->data = decompress_voxels(*cached.compressed);
+  auto end = high_resolution_clock::now();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  decompressTime = duration_cast<microseconds>(end - start).count() * 1e-6;
+  return brick;
+}
+void BrickCache::insert(const size_t timestep, const std::string &variable,
+    const int coarsenLevels, const std::shared_ptr<VolumeBrick> &brick)
+{
+  Cached cached;
+  if (compress) {
+    cached.brick = copy_brick_info(*brick);
+    cached.compressed = std::make_shared<CompressedVoxels>(
+        compress_voxels(brick->voxels(), brick->voxelBytes(), brick->voxelType));
+    cached.bytes = cached.compressed->compressedBytes();
+  } else {
+    cached.brick = brick;
+    cached.bytes = brick->voxelBytes();
+  }
+  if (cached.bytes > budget) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  const Key key(timestep, variable, coarsenLevels);
+  auto e = entries.find(key);
+  if (e != entries.end()) {
+    evict(e->second);
+  }
+  while (!lru.empty() && used + cached.bytes > budget) {
+    evict(std::prev(lru.end()));
+  }
+  lru.push_front(Entry(key, cached));
+  entries[key] = lru.begin();
+  used += cached.bytes;
+  rawBytes += brick->voxelBytes();
+}
+void BrickCache::evict(std::list<Entry>::iterator e) {
+  used -= e->second.bytes;
+  rawBytes -= e->second.compressed ? e->second.compressed->rawBytes
+    : e->second.brick->voxelBytes();
+  entries.erase(e->first);
+  lru.erase(e);
+}
+void BrickCache::countLookup(const bool hit) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (hit) {
+    ++hits;
+  } else {
+    ++misses;
+  }
+}
+void BrickCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  lru.clear();
+  entries.clear();
+  used = 0;
+  rawBytes = 0;
+}
+size_t BrickCache::hitCount() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return hits;
+}
+size_t BrickCache::missCount() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return misses;
+}
+size_t BrickCache::bytesUsed() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return used;
+}
+
+bool BrickCache::compressed() const {
+  return compress;
+}
+float BrickCache::compressionRatio() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return used > 0 ? static_cast<float>(rawBytes) / used : 1.f;
+}
+double BrickCache::lastDecompressTime() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return decompressTime;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "ospcommon/box.h"
+#include "util.h"
+#include "volume_stats.h"
+#include "brick_codec.h"
+#include "mapped_file.h"
+
+// A brick of a volume loaded by this rank, along with the info needed to
+// make an OSPRay volume from it without going back to PIDX.
+struct VolumeBrick {
+  std::vector<char> data;
+  // Bricks loaded from the disk cache have their voxels in the mapped file
+  // at mappingOffset instead of in data
+  std::shared_ptr<MappedFile> mapping;
+  size_t mappingOffset;
+  std::string voxelType;
+  vec3sz fullDims, localDims, localOffset, stride;
+  int resolution, maxResolution;
+  // The size of the brick's voxels in the world, smaller for finer AMR levels
+  float levelSpacing;
+  ospcommon::box3f localRegion;
+  // The value range of the variable over all ranks' bricks
+  ospcommon::vec2f valueRange;
+  // The range of the voxel values as stored, which differs from the value
+  // range if they were quantized
+  ospcommon::vec2f voxelRange;
+  // Histogram of the variable's values over all ranks' bricks, binned
+  // over valueRange
+  std::vector<uint64_t> histogram;
+  // Value ranges of the brick's macrocells, for empty space skipping
+  MacrocellGrid macrocells;
+
+  VolumeBrick();
+  // The brick's voxels, wherever they're stored
+  const char* voxels() const;
+  size_t voxelBytes() const;
+};
+
+/* A per-rank LRU cache of the bricks loaded for each timestep and variable,
+ * at each level of coarsening, holding at most budget bytes of brick data.
+ * The cache can be shared between the render thread and the timestep loader
+ * thread.
+ * If compress is set the cached bricks are kept compressed, counting their
+ * compressed size against the budget, and are decompressed when found.
+ */
+class BrickCache {
+  using Key = std::tuple<size_t, std::string, int>;
+  struct Cached {
+    // The brick, without its data if it's compressed
+    std::shared_ptr<VolumeBrick> brick;
+    std::shared_ptr<CompressedVoxels> compressed;
+    size_t bytes;
+  };
+  using Entry = std::pair<Key, Cached>;
+
+  size_t budget;
+  size_t used;
+  size_t hits, misses;
+  bool compress;
+  size_t rawBytes;
+  double decompressTime;
+  // Most recently used bricks are at the front
+  std::list<Entry> lru;
+  std::map<Key, std::list<Entry>::iterator> entries;
+  std::mutex mutex;
+
+  // Remove the entry from the cache, the mutex must be held
+  void evict(std::list<Entry>::iterator e);
+
+public:
+  BrickCache(const size_t budget, const bool compress = false);
+  BrickCache(const BrickCache &) = delete;
+  BrickCache& operator=(const BrickCache &) = delete;
+
+  // Find the brick for the timestep and variable read with the finest
+  // coarsenLevels HZ levels dropped, returns null if not cached
+  std::shared_ptr<VolumeBrick> find(const size_t timestep,
+      const std::string &variable, const int coarsenLevels);
+  /* Add a brick to the cache, evicting the least recently used bricks to
+   * stay under the budget. Bricks bigger than the budget aren't cached.
+   */
+  void insert(const size_t timestep, const std::string &variable,
+      const int coarsenLevels, const std::shared_ptr<VolumeBrick> &brick);
+  // Record whether a lookup was a hit, once all ranks agreed on it
+  void countLookup(const bool hit);
+  // Drop all the cached bricks, e.g. when they no longer cover what we load
+  void clear();
+  size_t hitCount();
+  size_t missCount();
+  size_t bytesUsed();
+  bool compressed() const;
+  // The ratio of the size of the cached bricks to their compressed size
+  float compressionRatio();
+  // The time in seconds taken to decompress the last brick found
+  double lastDecompressTime();
+};
+
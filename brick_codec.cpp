@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "ospcommon/tasking/parallel_for.h"
+#include "brick_codec.h"
+#include "volume_stats.h"
+
+using namespace ospcommon;
+
+// The number of voxels compressed together in a block, one task per block
+const size_t CODEC_BLOCK_SIZE = 1 << 16;
+// The longest literal and repeated runs in the run-length encoding. Control
+// bytes below 128 start a literal of c + 1 bytes, the others a repeat of the
+// next byte c - 125 times.
+const size_t MAX_LITERAL = 128;
+const size_t MIN_REPEAT = 3;
+const size_t MAX_REPEAT = 130;
+
+void encode_runs(const uint8_t *plane, const size_t n, std::vector<char> &out) {
+  size_t i = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < MAX_REPEAT && plane[i + run] == plane[i]) {
+      ++run;
+    }
+    if (run >= MIN_REPEAT) {
+      out.push_back(static_cast<char>(run + 125));
+      out.push_back(static_cast<char>(plane[i]));
+      i += run;
+      continue;
+    }
+    // Collect literals until the next repeat long enough to encode as a run
+    size_t end = i;
+    while (end < n && end - i < MAX_LITERAL) {
+      if (end + 2 < n && plane[end] == plane[end + 1] && plane[end] == plane[end + 2]) {
+        break;
+      }
+      ++end;
+    }
+    out.push_back(static_cast<char>(end - i - 1));
+    out.insert(out.end(), plane + i, plane + end);
+    i = end;
+  }
+}
+
+// Decode n bytes of runs starting at in, returns the end of the runs read
+const uint8_t* decode_runs(const uint8_t *in, const size_t n, uint8_t *plane) {
+  size_t i = 0;
+  while (i < n) {
+    const size_t c = *in++;
+    if (c < MAX_LITERAL) {
+      std::memcpy(plane + i, in, c + 1);
+      in += c + 1;
+      i += c + 1;
+    } else {
+      std::memset(plane + i, *in++, c - 125);
+      i += c - 125;
+    }
+  }
+  return in;
+}
+
+template<typename Word>
+std::vector<char> compress_block(const char *data, const size_t count,
+    const bool xorDelta)
+{
+  std::vector<Word> residuals(count);
+  Word prev = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Word w;
+    std::memcpy(&w, data + i * sizeof(Word), sizeof(Word));
+    residuals[i] = xorDelta ? w ^ prev : static_cast<Word>(w - prev);
+    prev = w;
+  }
+
+  std::vector<char> out;
+  std::vector<uint8_t> plane(count);
+  for (size_t b = 0; b < sizeof(Word); ++b) {
+    for (size_t i = 0; i < count; ++i) {
+      plane[i] = static_cast<uint8_t>(residuals[i] >> (8 * b));
+    }
+    encode_runs(plane.data(), count, out);
+  }
+  out.shrink_to_fit();
+  return out;
+}
+
+template<typename Word>
+void decompress_block(const std::vector<char> &block, const size_t count,
+    const bool xorDelta, char *data)
+{
+  std::vector<Word> residuals(count, 0);
+  std::vector<uint8_t> plane(count);
+  const uint8_t *in = reinterpret_cast<const uint8_t*>(block.data());
+  for (size_t b = 0; b < sizeof(Word); ++b) {
+    in = decode_runs(in, count, plane.data());
+    for (size_t i = 0; i < count; ++i) {
+      residuals[i] |= static_cast<Word>(plane[i]) << (8 * b);
+    }
+  }
+
+  Word prev = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const Word w = xorDelta ? residuals[i] ^ prev : static_cast<Word>(residuals[i] + prev);
+    std::memcpy(data + i * sizeof(Word), &w, sizeof(Word));
+    prev = w;
+  }
+}
+
+// Get the voxel size of the type, and if its deltas are taken with XOR
+size_t voxel_codec_params(const std::string &voxelType, bool &xorDelta) {
+  xorDelta = voxelType == "float" || voxelType == "double";
+  return voxel_size(voxelType);
+}
+
+CompressedVoxels::CompressedVoxels() : rawBytes(0) {}
+size_t CompressedVoxels::compressedBytes() const {
+  size_t bytes = 0;
+  for (const auto &b : blocks) {
+    bytes += b.size();
+  }
+  return bytes;
+}
+
+CompressedVoxels compress_voxels(const char *data, const size_t bytes,
+    const std::string &voxelType)
+{
+  bool xorDelta = false;
+  const size_t voxelSize = voxel_codec_params(voxelType, xorDelta);
+  const size_t count = bytes / voxelSize;
+  const size_t nblocks = (count + CODEC_BLOCK_SIZE - 1) / CODEC_BLOCK_SIZE;
+
+  CompressedVoxels compressed;
+  compressed.voxelType = voxelType;
+  compressed.rawBytes = bytes;
+  compressed.blocks.resize(nblocks);
+  tasking::parallel_for(nblocks, [&](const size_t b) {
+    const size_t begin = b * CODEC_BLOCK_SIZE;
+    const size_t n = std::min(count - begin, CODEC_BLOCK_SIZE);
+    const char *block = data + begin * voxelSize;
+    switch (voxelSize) {
+      case 1: compressed.blocks[b] = compress_block<uint8_t>(block, n, xorDelta); break;
+      case 2: compressed.blocks[b] = compress_block<uint16_t>(block, n, xorDelta); break;
+      case 4: compressed.blocks[b] = compress_block<uint32_t>(block, n, xorDelta); break;
+      default: compressed.blocks[b] = compress_block<uint64_t>(block, n, xorDelta); break;
+    }
+  });
+  return compressed;
+}
+
+std::vector<char> decompress_voxels(const CompressedVoxels &compressed) {
+  bool xorDelta = false;
+  const size_t voxelSize = voxel_codec_params(compressed.voxelType, xorDelta);
+  const size_t count = compressed.rawBytes / voxelSize;
+
+  std::vector<char> data(compressed.rawBytes);
+  tasking::parallel_for(compressed.blocks.size(), [&](const size_t b) {
+    const size_t begin = b * CODEC_BLOCK_SIZE;
+    const size_t n = std::min(count - begin, CODEC_BLOCK_SIZE);
+    char *block = data.data() + begin * voxelSize;
+    switch (voxelSize) {
+      case 1: decompress_block<uint8_t>(compressed.blocks[b], n, xorDelta, block); break;
+      case 2: decompress_block<uint16_t>(compressed.blocks[b], n, xorDelta, block); break;
+      case 4: decompress_block<uint32_t>(compressed.blocks[b], n, xorDelta, block); break;
+      default: decompress_block<uint64_t>(compressed.blocks[b], n, xorDelta, block); break;
+    }
+  });
+  return data;
+}
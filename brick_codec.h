@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* Voxel data compressed with a fast lossless block codec, for keeping bricks
+ * resident in memory while they're not being rendered. The voxels are split
+ * into fixed size blocks which are compressed and decompressed independently,
+ * in parallel. Each block stores the difference of each voxel from the
+ * previous one (XOR for floating point types), split into byte planes and
+ * run-length encoded, so smooth fields compress to their few changing bytes.
+ */
+struct CompressedVoxels {
+  std::string voxelType;
+  size_t rawBytes;
+  std::vector<std::vector<char>> blocks;
+
+  CompressedVoxels();
+  size_t compressedBytes() const;
+};
+
+// Compress the bytes of voxel data of the voxelType
+CompressedVoxels compress_voxels(const char *data, const size_t bytes,
+    const std::string &voxelType);
+
+// Decompress the voxels back to the original data
+std::vector<char> decompress_voxels(const CompressedVoxels &compressed);
+
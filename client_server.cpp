@@ -1,3 +1,4 @@
+#include <csignal>
 #include <iostream>
 #include <unistd.h>
 #include "client_server.h"
@@ -5,70 +6,119 @@
 ServerConnection::ServerConnection(const std::string &server, const int port,
     const AppState &app_state)
   : server_host(server), server_port(port), new_frame(false), app_state(app_state),
-  have_metadata(false)
+  detach(false), have_metadata(false), new_histogram(false)
 {
   server_thread = std::thread([&](){ connection_thread(); });
 }
 ServerConnection::~ServerConnection() {
   {
     std::lock_guard<std::mutex> lock(state_mutex);
-    app_state.quit = true;
+    detach = true;
   }
+  state_changed.notify_all();
   server_thread.join();
 }
 bool ServerConnection::get_metadata(std::vector<std::string> &vars,
       std::vector<size_t> &times, std::string &variableName,
-      size_t &timestep)
+      size_t &timestep, ospcommon::box3f &roi)
 {
   if (have_metadata) {
     vars = variables;
     times = timesteps;
     variableName = app_data.currentVariable;
     timestep = app_state.currentTimestep;
+    roi = app_state.roi;
     return true;
   }
   return false;
 }
-bool ServerConnection::get_new_frame(std::vector<unsigned char> &buf, int &time) {
+bool ServerConnection::get_new_frame(std::vector<unsigned char> &buf,
+    WorkerStatus &status)
+{
   std::lock_guard<std::mutex> lock(frame_mutex);
   if (new_frame) {
     buf = jpg_buf;
-    time = frame_time;
+    status = worker_status;
     new_frame = false;
     return true;
   }
   return false;
 }
+bool ServerConnection::get_histogram(ospcommon::vec2f &range,
+    std::vector<uint64_t> &hist)
+{
+  std::lock_guard<std::mutex> lock(histogram_mutex);
+  if (new_histogram) {
+    range = value_range;
+    hist = histogram;
+    new_histogram = false;
+    return true;
+  }
+  return false;
+}
 void ServerConnection::update_app_state(const AppState &state, const AppData &data) {
-  std::lock_guard<std::mutex> lock(state_mutex);
+  std::unique_lock<std::mutex> lock(state_mutex);
   app_state.v = state.v;
   app_state.fbSize = state.fbSize;
   if (state.timestepChanged) {
     app_state.currentTimestep = state.currentTimestep;
   }
+  if (state.roiChanged) {
+    app_state.roi = state.roi;
+  }
   app_state.cameraChanged = state.cameraChanged ? state.cameraChanged : app_state.cameraChanged;
   app_state.fbSizeChanged = state.fbSizeChanged ? state.fbSizeChanged : app_state.fbSizeChanged;
   app_state.tfcnChanged = state.tfcnChanged ? state.tfcnChanged : app_state.tfcnChanged;
   app_state.timestepChanged = state.timestepChanged ? state.timestepChanged : app_state.timestepChanged;
   app_state.fieldChanged = state.fieldChanged ? state.fieldChanged : app_state.fieldChanged;
+  app_state.roiChanged = state.roiChanged ? state.roiChanged : app_state.roiChanged;
 
   if (state.fieldChanged) {
     app_data.currentVariable = data.currentVariable;
   }
   app_data.tfcn_colors = data.tfcn_colors;
   app_data.tfcn_alphas = data.tfcn_alphas;
+  lock.unlock();
+  state_changed.notify_all();
+}
+void ServerConnection::shutdown_workers() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    app_state.quit = true;
+  }
+  state_changed.notify_all();
 }
 void ServerConnection::connection_thread() {
   ospcommon::networking::SocketFabric fabric(server_host, server_port);
   ospcommon::networking::BufferedReadStream read_stream(fabric);
   ospcommon::networking::BufferedWriteStream write_stream(fabric);
 
-  // Receive metadata from the server
-  read_stream >> variables >> timesteps >> app_data.currentVariable >> app_state.currentTimestep;
+  // Receive metadata from the server, which may have been left in another
+  // viewer's state, so our window size, camera and transfer function (once
+  // the widget has made one) go out with the first reply
+  std::string variable;
+  size_t timestep = 0;
+  ospcommon::box3f roi;
+  read_stream >> variables >> timesteps >> variable >> timestep >> roi;
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    app_data.currentVariable = variable;
+    app_state.currentTimestep = timestep;
+    app_state.roi = roi;
+    app_state.fbSizeChanged = true;
+    app_state.cameraChanged = true;
+    app_state.tfcnChanged = !app_data.tfcn_colors.empty();
+  }
+  {
+    std::lock_guard<std::mutex> lock(histogram_mutex);
+    read_stream >> value_range >> histogram;
+    new_histogram = true;
+  }
   have_metadata = true;
 
   while (true) {
     // Receive a frame from the server
+    bool converged = false;
     {
       unsigned long jpg_size = 0;
       read_stream >> jpg_size;
@@ -76,13 +126,32 @@ void ServerConnection::connection_thread() {
       std::lock_guard<std::mutex> lock(frame_mutex);
       jpg_buf.resize(jpg_size, 0);
       read_stream.read(jpg_buf.data(), jpg_size);
-      read_stream >> frame_time;
+      read_stream.read(&worker_status, sizeof(WorkerStatus));
       new_frame = true;
+      converged = worker_status.converged;
+    }
+    if (worker_status.newHistogram) {
+      std::lock_guard<std::mutex> lock(histogram_mutex);
+      read_stream >> value_range >> histogram;
+      new_histogram = true;
     }
 
-    // Send over the latest app state
+    // Send over the latest app state. The workers stop rendering once the
+    // image has converged, so we hold our reply until there's a change to send
     {
-      std::lock_guard<std::mutex> lock(state_mutex);
+      std::unique_lock<std::mutex> lock(state_mutex);
+      if (converged) {
+        state_changed.wait(lock, [&](){
+          return app_state.quit || detach || app_state.cameraChanged
+            || app_state.fbSizeChanged || app_state.tfcnChanged
+            || app_state.timestepChanged || app_state.fieldChanged
+            || app_state.roiChanged;
+        });
+      }
+      // Hang up without replying, the workers go idle until the next viewer
+      if (detach && !app_state.quit) {
+        return;
+      }
       write_stream.write(&app_state, sizeof(AppState));
       if (app_state.fieldChanged) {
         write_stream << app_data.currentVariable;
@@ -100,38 +169,159 @@ void ServerConnection::connection_thread() {
       app_state.fbSizeChanged = false;
       app_state.timestepChanged = false;
       app_state.fieldChanged = false;
+      app_state.roiChanged = false;
     }
   }
 }
 
 ClientConnection::ClientConnection(const int port)
-  : compressor(90), listener(port), fabric(listener.accept()), read_stream(fabric), write_stream(fabric)
-{}
+  : compressor(90), listener(port)
+{
+  // Writing to a client that's gone should throw, not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+}
+void ClientConnection::accept() {
+  disconnect();
+  fabric = ospcommon::make_unique<ospcommon::networking::SocketFabric>(listener.accept());
+  read_stream = ospcommon::make_unique<ospcommon::networking::BufferedReadStream>(*fabric);
+  write_stream = ospcommon::make_unique<ospcommon::networking::BufferedWriteStream>(*fabric);
+}
+void ClientConnection::disconnect() {
+  read_stream = nullptr;
+  write_stream = nullptr;
+  fabric = nullptr;
+}
 void ClientConnection::send_metadata(const std::vector<std::string> &vars,
     const std::set<UintahTimestep> &timesteps, const std::string &variableName,
-    const size_t timestep)
+    const size_t timestep, const ospcommon::box3f &roi,
+    const ospcommon::vec2f &valueRange, const std::vector<uint64_t> &histogram)
 {
   std::vector<size_t> times;
   for (const auto &t : timesteps) {
     times.push_back(t.timestep);
   }
-  write_stream << vars << times << variableName << timestep;
-  write_stream.flush();
+  *write_stream << vars << times << variableName << timestep << roi
+    << valueRange << histogram;
+  write_stream->flush();
 }
-void ClientConnection::send_frame(uint32_t *img, int width, int height, int frame_time) {
+void ClientConnection::send_frame(uint32_t *img, int width, int height,
+    const WorkerStatus &status, const ospcommon::vec2f &valueRange,
+    const std::vector<uint64_t> &histogram)
+{
   auto jpg = compressor.compress(img, width, height);
-  write_stream << jpg.second;
-  write_stream.write(jpg.first, jpg.second);
-  write_stream << frame_time;
-  write_stream.flush();
+  *write_stream << jpg.second;
+  write_stream->write(jpg.first, jpg.second);
+  write_stream->write(&status, sizeof(WorkerStatus));
+  if (status.newHistogram) {
+    *write_stream << valueRange << histogram;
+  }
+  write_stream->flush();
 }
 void ClientConnection::recieve_app_state(AppState &app, AppData &data) {
-  read_stream.read(&app, sizeof(AppState));
+  read_stream->read(&app, sizeof(AppState));
   if (app.fieldChanged) {
-    read_stream >> data.currentVariable;
+    *read_stream >> data.currentVariable;
   }
   if (app.tfcnChanged) {
-    read_stream >> data.tfcn_colors >> data.tfcn_alphas;
+    *read_stream >> data.tfcn_colors >> data.tfcn_alphas;
   }
 }
 
+FrameSender::FrameSender(ClientConnection &client)
+  : client(client), width(0), height(0), sending(false), have_reply(false),
+  connected(false), quit(false)
+{
+  sender_thread = std::thread([&](){ sender_loop(); });
+}
+FrameSender::~FrameSender() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  cond.notify_all();
+  sender_thread.join();
+}
+void FrameSender::send_frame(const uint32_t *frame, int w, int h,
+    const WorkerStatus &frameStatus, const ospcommon::vec2f &valueRange,
+    const std::vector<uint64_t> &hist)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&](){ return !sending; });
+  img.assign(frame, frame + w * h);
+  width = w;
+  height = h;
+  status = frameStatus;
+  if (status.newHistogram) {
+    value_range = valueRange;
+    histogram = hist;
+  }
+  sending = true;
+  lock.unlock();
+  cond.notify_all();
+}
+bool FrameSender::wait_app_state(AppState &app, AppData &data) {
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&](){ return !sending; });
+  if (!have_reply) {
+    return connected;
+  }
+  app = app_state;
+  if (app.fieldChanged) {
+    data.currentVariable = app_data.currentVariable;
+  }
+  if (app.tfcnChanged) {
+    data.tfcn_colors = app_data.tfcn_colors;
+    data.tfcn_alphas = app_data.tfcn_alphas;
+  }
+  have_reply = false;
+  return connected;
+}
+bool FrameSender::accept_client(const std::function<void(ClientConnection&)> &greet) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&](){ return !sending; });
+  }
+  // The sender thread only uses the client while sending, which only we
+  // start, so we have it to ourselves until the next send_frame
+  bool greeted = false;
+  client.accept();
+  try {
+    greet(client);
+    greeted = true;
+  } catch (const std::exception &e) {
+    std::cerr << "Lost the client connection: " << e.what() << "\n";
+    client.disconnect();
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  connected = greeted;
+  return greeted;
+}
+void FrameSender::sender_loop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&](){ return quit || sending; });
+      if (!sending) {
+        return;
+      }
+    }
+    // The main thread doesn't touch the frame, reply or client while we're
+    // sending
+    bool replied = false;
+    try {
+      client.send_frame(img.data(), width, height, status, value_range, histogram);
+      client.recieve_app_state(app_state, app_data);
+      replied = true;
+    } catch (const std::exception &e) {
+      std::cerr << "Lost the client connection: " << e.what() << "\n";
+      client.disconnect();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sending = false;
+      have_reply = replied;
+      connected = replied;
+    }
+    cond.notify_all();
+  }
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <thread>
 #include <set>
+#include <memory>
 #include <mutex>
 #include "ospcommon/networking/Socket.h"
 #include "ospcommon/networking/SocketFabric.h"
@@ -17,55 +21,148 @@ class ServerConnection {
   int server_port;
 
   std::vector<unsigned char> jpg_buf;
-  int frame_time;
+  WorkerStatus worker_status;
   bool new_frame;
   std::mutex frame_mutex;
 
   AppState app_state;
   AppData app_data;
   std::mutex state_mutex;
+  // Signalled when the app state changes, to wake us up to reply to a
+  // converged frame
+  std::condition_variable state_changed;
+  // Set when we're closing, to disconnect without telling the workers to quit
+  bool detach;
 
   std::thread server_thread;
   std::vector<std::string> variables;
   std::vector<size_t> timesteps;
   std::atomic<bool> have_metadata;
 
+  ospcommon::vec2f value_range;
+  std::vector<uint64_t> histogram;
+  bool new_histogram;
+  std::mutex histogram_mutex;
+
 public:
   ServerConnection(const std::string &server, const int port,
       const AppState &app_state);
+  /* Disconnect from the workers, which keep the data loaded and wait for
+   * another viewer to connect unless shutdown_workers was called.
+   */
   ~ServerConnection();
   /* Check if we've gotten metadata back from the server, returns true
    * if we have, in which case the vectors will contain the corresponding
-   * meta data returned.
+   * meta data returned, along with the workers' current variable, timestep
+   * and region of interest.
    */
   bool get_metadata(std::vector<std::string> &vars,
       std::vector<size_t> &timesteps, std::string &variableName,
-      size_t &timestep);
+      size_t &timestep, ospcommon::box3f &roi);
   /* Get the new JPG recieved from the network, if we've got a new one,
-   * otherwise the buf is unchanged.
+   * otherwise the buf is unchanged. The worker status sent with the frame
+   * is returned in status.
+   */
+  bool get_new_frame(std::vector<unsigned char> &buf, WorkerStatus &status);
+  /* Get the histogram of the current variable's values and the value range
+   * it spans, if we've gotten a new one, otherwise they're unchanged.
    */
-  bool get_new_frame(std::vector<unsigned char> &buf, int &frame_time);
+  bool get_histogram(ospcommon::vec2f &range, std::vector<uint64_t> &hist);
   // Update the app state to be sent over the network for the next frame
   void update_app_state(const AppState &state, const AppData &data);
+  // Tell the workers to quit with our next reply
+  void shutdown_workers();
 
 private:
   void connection_thread();
 };
 
-// A client connecting to the render worker server
+/* The render worker server's connection to the client. The server keeps
+ * listening for clients, so a new client can connect after the last one
+ * disconnected. Sending to or receiving from a disconnected client throws.
+ */
 class ClientConnection {
   JPGCompressor compressor;
   ospcommon::networking::SocketListener listener;
-  ospcommon::networking::SocketFabric fabric;
-  ospcommon::networking::BufferedReadStream read_stream;
-  ospcommon::networking::BufferedWriteStream write_stream;
+  std::unique_ptr<ospcommon::networking::SocketFabric> fabric;
+  std::unique_ptr<ospcommon::networking::BufferedReadStream> read_stream;
+  std::unique_ptr<ospcommon::networking::BufferedWriteStream> write_stream;
 
 public:
+  // Start listening for clients on the port, call accept to wait for one
   ClientConnection(const int port);
+  // Wait for a client to connect
+  void accept();
+  // Drop the current client, e.g. once it's disconnected
+  void disconnect();
   void send_metadata(const std::vector<std::string> &vars,
       const std::set<UintahTimestep> &timesteps,
-      const std::string &variableName, const size_t timestep);
-  void send_frame(uint32_t *img, int width, int height, int frame_time);
+      const std::string &variableName, const size_t timestep,
+      const ospcommon::box3f &roi, const ospcommon::vec2f &valueRange,
+      const std::vector<uint64_t> &histogram);
+  /* Send the frame along with the worker's status. If the status says
+   * there's a new histogram it's sent along with the frame.
+   */
+  void send_frame(uint32_t *img, int width, int height,
+      const WorkerStatus &status, const ospcommon::vec2f &valueRange,
+      const std::vector<uint64_t> &histogram);
   void recieve_app_state(AppState &app, AppData &data);
 };
 
+/* Sends frames to the client on a background thread, so the workers can
+ * render the next frame while the last one is compressed and sent and the
+ * client's reply is received. Each frame sent must be followed by a call to
+ * wait_app_state to get the client's reply before sending the next one.
+ * If the client disconnects the client connection is dropped, and a new
+ * client can be accepted with accept_client. The client connection is only
+ * used through the sender, so it's never touched while a frame is sent.
+ */
+class FrameSender {
+  ClientConnection &client;
+
+  std::vector<uint32_t> img;
+  int width, height;
+  WorkerStatus status;
+  ospcommon::vec2f value_range;
+  std::vector<uint64_t> histogram;
+  // Set while a frame is waiting to be sent or for the client's reply
+  bool sending;
+
+  AppState app_state;
+  AppData app_data;
+  bool have_reply;
+  // If a client is connected, only changed while we aren't sending
+  bool connected;
+
+  bool quit;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::thread sender_thread;
+
+public:
+  FrameSender(ClientConnection &client);
+  ~FrameSender();
+  FrameSender(const FrameSender &) = delete;
+  FrameSender& operator=(const FrameSender &) = delete;
+
+  /* Start sending the frame, the image and histogram are copied so the
+   * caller is free to change them once this returns.
+   */
+  void send_frame(const uint32_t *img, int width, int height,
+      const WorkerStatus &status, const ospcommon::vec2f &valueRange,
+      const std::vector<uint64_t> &histogram);
+  /* Wait for the client's reply to the last frame sent and put the app state
+   * it sent in app and data, as recieve_app_state does. If there was no
+   * frame being sent or the client disconnected app and data are left
+   * unchanged. Returns whether a client is still connected.
+   */
+  bool wait_app_state(AppState &app, AppData &data);
+  /* Wait for the last frame to finish sending, then wait for a new client to
+   * connect and call greet to send it whatever it needs before the first
+   * frame. Returns false if the client disconnected while being greeted.
+   */
+  bool accept_client(const std::function<void(ClientConnection&)> &greet);
+
+private:
+  void sender_loop();
+};
@@ -0,0 +1,183 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "disk_cache.h"
+
+using namespace ospcommon;
+
+// Identifies brick files, changed if the layout of the file changes
+const char BRICK_FILE_MAGIC[8] = {'P', 'I', 'D', 'X', 'B', 'R', 'K', '2'};
+// The voxels start at a multiple of the page size in the file
+const size_t BRICK_DATA_ALIGNMENT = 4096;
+
+template<typename T>
+void write_pod(std::ostream &os, const T &x) {
+  os.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+void write_string(std::ostream &os, const std::string &s) {
+  write_pod(os, uint64_t(s.size()));
+  os.write(s.data(), s.size());
+}
+template<typename T>
+void write_vector(std::ostream &os, const std::vector<T> &v) {
+  write_pod(os, uint64_t(v.size()));
+  os.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+// Reads the fields written above back out of the mapped file
+struct BrickFileReader {
+  const char *ptr, *end;
+
+  BrickFileReader(const char *begin, const char *end) : ptr(begin), end(end) {}
+  void read(void *out, const size_t bytes) {
+    if (bytes > size_t(end - ptr)) {
+      throw std::runtime_error("Brick file is truncated");
+    }
+    std::memcpy(out, ptr, bytes);
+    ptr += bytes;
+  }
+  template<typename T>
+  T pod() {
+    T x;
+    read(&x, sizeof(T));
+    return x;
+  }
+  std::string string() {
+    std::string s(pod<uint64_t>(), '\0');
+    read(&s[0], s.size());
+    return s;
+  }
+  template<typename T>
+  std::vector<T> vector() {
+    std::vector<T> v(pod<uint64_t>());
+    read(v.data(), v.size() * sizeof(T));
+    return v;
+  }
+};
+
+DiskBrickCache::DiskBrickCache(const std::string &directory)
+  : directory(directory)
+{
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Failed to create disk cache directory " + directory
+        + ": " + std::strerror(errno));
+  }
+}
+std::shared_ptr<VolumeBrick> DiskBrickCache::load(const std::string &key,
+    std::vector<std::string> &variables) const
+{
+  const std::string path = filePath(key);
+  struct stat fileStat = {0};
+  if (stat(path.c_str(), &fileStat) != 0) {
+    return nullptr;
+  }
+  try {
+    auto mapping = std::make_shared<MappedFile>(path);
+    BrickFileReader reader(mapping->data(), mapping->data() + mapping->size());
+    char magic[8];
+    reader.read(magic, sizeof(magic));
+    // Different keys can hash to the same file, so check it's our brick
+    if (std::memcmp(magic, BRICK_FILE_MAGIC, sizeof(magic)) != 0
+        || reader.string() != key)
+    {
+      return nullptr;
+    }
+
+    auto brick = std::make_shared<VolumeBrick>();
+    const uint64_t numVariables = reader.pod<uint64_t>();
+    variables.clear();
+    for (uint64_t i = 0; i < numVariables; ++i) {
+      variables.push_back(reader.string());
+    }
+    brick->voxelType = reader.string();
+    brick->fullDims = reader.pod<vec3sz>();
+    brick->localDims = reader.pod<vec3sz>();
+    brick->localOffset = reader.pod<vec3sz>();
+    brick->stride = reader.pod<vec3sz>();
+    brick->resolution = reader.pod<int>();
+    brick->maxResolution = reader.pod<int>();
+    brick->levelSpacing = reader.pod<float>();
+    brick->localRegion = reader.pod<box3f>();
+    brick->valueRange = reader.pod<vec2f>();
+    brick->voxelRange = reader.pod<vec2f>();
+    brick->histogram = reader.vector<uint64_t>();
+    brick->macrocells.cellSize = reader.pod<uint64_t>();
+    brick->macrocells.dims = reader.pod<vec3sz>();
+    brick->macrocells.ranges = reader.vector<vec2f>();
+    const uint64_t dataOffset = reader.pod<uint64_t>();
+    const uint64_t dataBytes = reader.pod<uint64_t>();
+    if (dataOffset + dataBytes > mapping->size()
+        || dataBytes != brick->localDims.x * brick->localDims.y * brick->localDims.z
+          * voxel_size(brick->voxelType))
+    {
+      throw std::runtime_error("Brick file is truncated");
+    }
+    brick->mapping = mapping;
+    brick->mappingOffset = dataOffset;
+    return brick;
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to load cached brick " << path << ": " << e.what() << "\n";
+  }
+  return nullptr;
+}
+void DiskBrickCache::store(const std::string &key, const VolumeBrick &brick,
+    const std::vector<std::string> &variables) const
+{
+  const std::string path = filePath(key);
+  const std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(BRICK_FILE_MAGIC, sizeof(BRICK_FILE_MAGIC));
+    write_string(file, key);
+    write_pod(file, uint64_t(variables.size()));
+    for (const auto &v : variables) {
+      write_string(file, v);
+    }
+    write_string(file, brick.voxelType);
+    write_pod(file, brick.fullDims);
+    write_pod(file, brick.localDims);
+    write_pod(file, brick.localOffset);
+    write_pod(file, brick.stride);
+    write_pod(file, brick.resolution);
+    write_pod(file, brick.maxResolution);
+    write_pod(file, brick.levelSpacing);
+    write_pod(file, brick.localRegion);
+    write_pod(file, brick.valueRange);
+    write_pod(file, brick.voxelRange);
+    write_vector(file, brick.histogram);
+    write_pod(file, uint64_t(brick.macrocells.cellSize));
+    write_pod(file, brick.macrocells.dims);
+    write_vector(file, brick.macrocells.ranges);
+
+    // Pad out so the voxels start on a page
+    const uint64_t headerEnd = static_cast<uint64_t>(file.tellp()) + 2 * sizeof(uint64_t);
+    const uint64_t dataOffset = ((headerEnd + BRICK_DATA_ALIGNMENT - 1)
+        / BRICK_DATA_ALIGNMENT) * BRICK_DATA_ALIGNMENT;
+    write_pod(file, dataOffset);
+    write_pod(file, uint64_t(brick.voxelBytes()));
+    const std::vector<char> padding(dataOffset - headerEnd, 0);
+    file.write(padding.data(), padding.size());
+    file.write(brick.voxels(), brick.voxelBytes());
+    if (!file) {
+      std::cerr << "Failed to write cached brick " << tmpPath << "\n";
+      std::remove(tmpPath.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::cerr << "Failed to move cached brick into place at " << path << "\n";
+    std::remove(tmpPath.c_str());
+  }
+}
+std::string DiskBrickCache::filePath(const std::string &key) const {
+  std::stringstream name;
+  name << directory << "/brick-" << std::hex << std::hash<std::string>()(key) << ".bin";
+  return name.str();
+}
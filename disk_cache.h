@@ -0,0 +1,38 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "brick_cache.h"
+
+/* A cache of the bricks this rank has loaded, kept as files in a directory
+ * on node-local storage so restarted workers can skip re-reading them from
+ * the parallel filesystem. Bricks are looked up by a key identifying the
+ * dataset, timestep, variable and decomposition the brick was read with,
+ * and are memory mapped when loaded so their voxels go to OSPRay without
+ * being copied into memory first.
+ */
+class DiskBrickCache {
+  std::string directory;
+
+public:
+  // Use the directory for the cache, creating it if it doesn't exist
+  DiskBrickCache(const std::string &directory);
+
+  /* Map the brick stored for the key, setting variables to the dataset's
+   * variables at the time it was stored. Returns null if there's no brick
+   * for the key or its file can't be read.
+   */
+  std::shared_ptr<VolumeBrick> load(const std::string &key,
+      std::vector<std::string> &variables) const;
+  /* Write the brick for the key. The file is written under a temporary name
+   * and renamed once it's complete, so a crash won't leave a partial brick.
+   * Failing to write the brick only prints a warning.
+   */
+  void store(const std::string &key, const VolumeBrick &brick,
+      const std::vector<std::string> &variables) const;
+
+private:
+  std::string filePath(const std::string &key) const;
+};
+
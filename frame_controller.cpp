@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <cmath>
+#include "frame_controller.h"
+
+// The range each setting is adjusted over. The sampling rate starts at
+// OSPRay's default for volumes.
+const float MIN_SCALE = 0.25f;
+const int MAX_SPP = 8;
+const float DEFAULT_SAMPLING_RATE = 0.125f;
+const float MIN_SAMPLING_RATE = 0.015625f;
+const float MAX_SAMPLING_RATE = 1.f;
+// Frame times within this fraction of the target are left alone
+const float FRAME_TIME_TOLERANCE = 0.2f;
+
+FrameSettings::FrameSettings() : scale(1.f), spp(1),
+  samplingRate(DEFAULT_SAMPLING_RATE)
+{}
+
+FrameRateController::FrameRateController(const float targetFps)
+  : targetMs(1000.f / targetFps)
+{}
+bool FrameRateController::update(const float frameMs) {
+  // The cost of a frame is proportional to its passes, sampling rate and
+  // pixels, so this is how much we can scale the cost by to hit the target
+  const float headroom = std::min(std::max(targetMs / std::max(frameMs, 1.f), 0.25f), 4.f);
+  if (headroom < 1.f / (1.f + FRAME_TIME_TOLERANCE)) {
+    if (settings.spp > 1) {
+      settings.spp = std::max(static_cast<int>(settings.spp * headroom), 1);
+    } else if (settings.samplingRate > MIN_SAMPLING_RATE) {
+      settings.samplingRate = std::max(settings.samplingRate * headroom, MIN_SAMPLING_RATE);
+    } else if (settings.scale > MIN_SCALE) {
+      settings.scale = std::max(settings.scale * std::sqrt(headroom), MIN_SCALE);
+    } else {
+      return false;
+    }
+    return true;
+  }
+  if (headroom > 1.f + FRAME_TIME_TOLERANCE) {
+    if (settings.scale < 1.f) {
+      settings.scale = std::min(settings.scale * std::sqrt(headroom), 1.f);
+    } else if (settings.samplingRate < MAX_SAMPLING_RATE) {
+      settings.samplingRate = std::min(settings.samplingRate * headroom, MAX_SAMPLING_RATE);
+    } else {
+      // Passes only come in whole numbers, so only add them if we have room
+      // for all of them
+      const int spp = std::min(static_cast<int>(settings.spp * headroom), MAX_SPP);
+      if (spp <= settings.spp) {
+        return false;
+      }
+      settings.spp = spp;
+    }
+    return true;
+  }
+  return false;
+}
+const FrameSettings& FrameRateController::current() const {
+  return settings;
+}
+
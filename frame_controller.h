@@ -0,0 +1,34 @@
+#pragma once
+
+/* The quality settings for rendering a frame: the fraction of the window's
+ * resolution rendered, the number of passes accumulated per frame and the
+ * volume's sampling rate.
+ */
+struct FrameSettings {
+  float scale;
+  int spp;
+  float samplingRate;
+
+  FrameSettings();
+};
+
+/* Adjusts the frame settings to keep the frame time near a target, based on
+ * how long the last frame took. Quality is lowered by first dropping passes,
+ * then the sampling rate, then the resolution, and raised again in the
+ * reverse order. The settings are only changed when the frame time is well
+ * off the target, and only raised when the predicted frame time stays under
+ * it, so they settle on a steady view and the image can keep accumulating.
+ */
+class FrameRateController {
+  float targetMs;
+  FrameSettings settings;
+
+public:
+  FrameRateController(const float targetFps);
+
+  // Update the settings for the time the last frame took, returns true if
+  // they changed
+  bool update(const float frameMs);
+  const FrameSettings& current() const;
+};
+
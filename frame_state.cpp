@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include "frame_state.h"
+
+using namespace ospcommon;
+
+// Changed if the layout of the message changes
+const uint32_t FRAME_STATE_VERSION = 1;
+// The bytes of the message posted each frame, which fits everything but a
+// new transfer function or a long variable name
+const size_t FRAME_STATE_BYTES = 512;
+
+// The fields in the message, which are packed in this order after the header
+enum FrameStateField {
+  FIELD_QUIT = 1,
+  FIELD_IDLE = 1 << 1,
+  FIELD_INTERACTING = 1 << 2,
+  FIELD_CAMERA = 1 << 3,
+  FIELD_FB_SIZE = 1 << 4,
+  FIELD_TIMESTEP = 1 << 5,
+  FIELD_ROI = 1 << 6,
+  FIELD_SETTINGS = 1 << 7,
+  FIELD_VARIABLE = 1 << 8,
+  FIELD_TFCN = 1 << 9,
+};
+
+struct FrameStateHeader {
+  uint32_t version;
+  uint32_t frame;
+  uint32_t fields;
+  // The size of the whole message, including the header
+  uint32_t bytes;
+};
+
+struct FrameStateWriter {
+  std::vector<char> &out;
+
+  FrameStateWriter(std::vector<char> &out) : out(out) {}
+  void write(const void *data, const size_t bytes) {
+    const char *c = reinterpret_cast<const char*>(data);
+    out.insert(out.end(), c, c + bytes);
+  }
+  template<typename T>
+  void pod(const T &x) {
+    write(&x, sizeof(T));
+  }
+  template<typename T>
+  void vector(const std::vector<T> &v) {
+    pod(uint32_t(v.size()));
+    write(v.data(), v.size() * sizeof(T));
+  }
+  void string(const std::string &s) {
+    pod(uint32_t(s.size()));
+    write(s.data(), s.size());
+  }
+};
+
+struct FrameStateReader {
+  const char *ptr, *end;
+
+  FrameStateReader(const char *begin, const char *end) : ptr(begin), end(end) {}
+  void read(void *out, const size_t bytes) {
+    if (bytes > size_t(end - ptr)) {
+      throw std::runtime_error("Frame state message is truncated");
+    }
+    std::memcpy(out, ptr, bytes);
+    ptr += bytes;
+  }
+  template<typename T>
+  T pod() {
+    T x;
+    read(&x, sizeof(T));
+    return x;
+  }
+  template<typename T>
+  std::vector<T> vector() {
+    std::vector<T> v(pod<uint32_t>());
+    read(v.data(), v.size() * sizeof(T));
+    return v;
+  }
+  std::string string() {
+    std::string s(pod<uint32_t>(), '\0');
+    read(&s[0], s.size());
+    return s;
+  }
+};
+
+FrameState::FrameState() : idle(false), interacting(false),
+  settingsChanged(false)
+{}
+
+FrameStateBroadcast::FrameStateBroadcast(MPI_Comm parent)
+  : frame(0), message(FRAME_STATE_BYTES, 0), request(MPI_REQUEST_NULL)
+{
+  MPI_Comm_dup(parent, &comm);
+  MPI_Comm_rank(comm, &rank);
+}
+FrameStateBroadcast::~FrameStateBroadcast() {
+  MPI_Comm_free(&comm);
+}
+void FrameStateBroadcast::post() {
+  message.resize(FRAME_STATE_BYTES);
+  MPI_Ibcast(message.data(), FRAME_STATE_BYTES, MPI_BYTE, 0, comm, &request);
+}
+void FrameStateBroadcast::send(const AppState &app, const AppData &appdata,
+    const FrameState &state)
+{
+  FrameStateHeader header = {FRAME_STATE_VERSION, frame, 0, 0};
+  header.fields |= app.quit ? FIELD_QUIT : 0;
+  header.fields |= state.idle ? FIELD_IDLE : 0;
+  header.fields |= state.interacting ? FIELD_INTERACTING : 0;
+  header.fields |= app.cameraChanged ? FIELD_CAMERA : 0;
+  header.fields |= app.fbSizeChanged ? FIELD_FB_SIZE : 0;
+  header.fields |= app.timestepChanged ? FIELD_TIMESTEP : 0;
+  header.fields |= app.roiChanged ? FIELD_ROI : 0;
+  header.fields |= state.settingsChanged ? FIELD_SETTINGS : 0;
+  header.fields |= app.fieldChanged ? FIELD_VARIABLE : 0;
+  header.fields |= app.tfcnChanged ? FIELD_TFCN : 0;
+
+  message.clear();
+  FrameStateWriter writer(message);
+  writer.pod(header);
+  if (header.fields & FIELD_CAMERA) {
+    writer.pod(app.v);
+  }
+  if (header.fields & FIELD_FB_SIZE) {
+    writer.pod(app.fbSize);
+  }
+  if (header.fields & FIELD_TIMESTEP) {
+    writer.pod(uint64_t(app.currentTimestep));
+  }
+  if (header.fields & FIELD_ROI) {
+    writer.pod(app.roi);
+  }
+  if (header.fields & FIELD_SETTINGS) {
+    writer.pod(state.settings);
+  }
+  if (header.fields & FIELD_VARIABLE) {
+    writer.string(appdata.currentVariable);
+  }
+  if (header.fields & FIELD_TFCN) {
+    writer.vector(appdata.tfcn_colors);
+    writer.vector(appdata.tfcn_alphas);
+  }
+  header.bytes = message.size();
+  std::memcpy(message.data(), &header, sizeof(header));
+  message.resize(std::max(message.size(), FRAME_STATE_BYTES), 0);
+
+  MPI_Ibcast(message.data(), FRAME_STATE_BYTES, MPI_BYTE, 0, comm, &request);
+}
+void FrameStateBroadcast::finish(AppState &app, AppData &appdata, FrameState &state,
+    const bool idle)
+{
+  if (idle) {
+    int done = 0;
+    MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    while (!done) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+    }
+  } else {
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+  }
+
+  FrameStateHeader header;
+  std::memcpy(&header, message.data(), sizeof(header));
+  if (header.version != FRAME_STATE_VERSION || header.frame != frame) {
+    throw std::runtime_error("Received frame state for the wrong frame or version");
+  }
+  ++frame;
+  if (header.bytes > FRAME_STATE_BYTES) {
+    message.resize(header.bytes);
+    MPI_Bcast(message.data() + FRAME_STATE_BYTES, header.bytes - FRAME_STATE_BYTES,
+        MPI_BYTE, 0, comm);
+  }
+  if (rank == 0) {
+    return;
+  }
+
+  FrameStateReader reader(message.data() + sizeof(header), message.data() + header.bytes);
+  app.quit = header.fields & FIELD_QUIT;
+  state.idle = header.fields & FIELD_IDLE;
+  state.interacting = header.fields & FIELD_INTERACTING;
+  app.cameraChanged = header.fields & FIELD_CAMERA;
+  if (app.cameraChanged) {
+    app.v = reader.pod<std::array<vec3f, 3>>();
+  }
+  app.fbSizeChanged = header.fields & FIELD_FB_SIZE;
+  if (app.fbSizeChanged) {
+    app.fbSize = reader.pod<vec2i>();
+  }
+  app.timestepChanged = header.fields & FIELD_TIMESTEP;
+  if (app.timestepChanged) {
+    app.currentTimestep = reader.pod<uint64_t>();
+  }
+  app.roiChanged = header.fields & FIELD_ROI;
+  if (app.roiChanged) {
+    app.roi = reader.pod<box3f>();
+  }
+  state.settingsChanged = header.fields & FIELD_SETTINGS;
+  if (state.settingsChanged) {
+    state.settings = reader.pod<FrameSettings>();
+  }
+  app.fieldChanged = header.fields & FIELD_VARIABLE;
+  if (app.fieldChanged) {
+    appdata.currentVariable = reader.string();
+  }
+  app.tfcnChanged = header.fields & FIELD_TFCN;
+  if (app.tfcnChanged) {
+    appdata.tfcn_colors = reader.vector<vec3f>();
+    appdata.tfcn_alphas = reader.vector<float>();
+  }
+}
+
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <mpi.h>
+#include "util.h"
+#include "frame_controller.h"
+
+// What rank 0 decided about the next frame, sent along with the app state
+struct FrameState {
+  // If we should stop rendering and idle until the app changes, because the
+  // last frame converged or no viewer is connected, and if the camera is
+  // still moving
+  bool idle, interacting;
+  // The frame settings picked by the frame rate controller, and if they
+  // changed this frame
+  FrameSettings settings;
+  bool settingsChanged;
+
+  FrameState();
+};
+
+/* Shares the app state and the frame state from rank 0 with the other ranks
+ * once per frame, in a single message with only the fields that changed.
+ * The message is broadcast with a non-blocking collective on a duplicate of
+ * the communicator, which the other ranks post before rendering and rank 0
+ * once it has the viewer's reply, so the broadcast overlaps with the end of
+ * the frame on the ranks still rendering. Messages larger than the fixed
+ * size posted, e.g. with a new transfer function, send the rest in a second
+ * broadcast.
+ */
+class FrameStateBroadcast {
+  MPI_Comm comm;
+  int rank;
+  uint32_t frame;
+  // The message being sent or received this frame
+  std::vector<char> message;
+  MPI_Request request;
+
+public:
+  FrameStateBroadcast(MPI_Comm comm);
+  ~FrameStateBroadcast();
+  FrameStateBroadcast(const FrameStateBroadcast &) = delete;
+  FrameStateBroadcast& operator=(const FrameStateBroadcast &) = delete;
+
+  // On the ranks other than 0, start receiving the next frame's state
+  void post();
+  // On rank 0, pack the changed fields of the state and start sending it
+  void send(const AppState &app, const AppData &appdata, const FrameState &state);
+  /* Wait for the broadcast to finish and unpack the state received on the
+   * other ranks. If idle we sleep between checking if it's done instead of
+   * spinning in MPI. Every rank must call this each frame.
+   */
+  void finish(AppState &app, AppData &appdata, FrameState &state, const bool idle);
+};
+
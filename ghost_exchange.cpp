@@ -0,0 +1,122 @@
+#include <array>
+#include <cstring>
+#include "ghost_exchange.h"
+
+// Copy the box [lower, upper) of the brick with dims voxels into buf
+void pack_box(const std::vector<char> &data, const vec3sz &dims, const vec3sz &lower,
+    const vec3sz &upper, const size_t voxelSize, std::vector<char> &buf)
+{
+  const size_t rowBytes = (upper.x - lower.x) * voxelSize;
+  buf.resize(rowBytes * (upper.y - lower.y) * (upper.z - lower.z));
+  char *out = buf.data();
+  for (size_t z = lower.z; z < upper.z; ++z) {
+    for (size_t y = lower.y; y < upper.y; ++y, out += rowBytes) {
+      std::memcpy(out, data.data() + ((z * dims.y + y) * dims.x + lower.x) * voxelSize,
+          rowBytes);
+    }
+  }
+}
+// Copy buf into the box [lower, upper) of the brick with dims voxels
+void unpack_box(const std::vector<char> &buf, const vec3sz &dims, const vec3sz &lower,
+    const vec3sz &upper, const size_t voxelSize, std::vector<char> &data)
+{
+  const size_t rowBytes = (upper.x - lower.x) * voxelSize;
+  const char *in = buf.data();
+  for (size_t z = lower.z; z < upper.z; ++z) {
+    for (size_t y = lower.y; y < upper.y; ++y, in += rowBytes) {
+      std::memcpy(data.data() + ((z * dims.y + y) * dims.x + lower.x) * voxelSize, in,
+          rowBytes);
+    }
+  }
+}
+
+void pad_brick(std::vector<char> &data, const vec3sz &ownedDims,
+    const vec3sz &ghostLower, const vec3sz &dims, const size_t voxelSize)
+{
+  if (ownedDims == dims) {
+    return;
+  }
+  data.resize(dims.x * dims.y * dims.z * voxelSize);
+  // Every row moves to a later position, so moving the last row first never
+  // overwrites a row we haven't moved yet
+  const size_t rowBytes = ownedDims.x * voxelSize;
+  for (size_t z = ownedDims.z; z-- > 0;) {
+    for (size_t y = ownedDims.y; y-- > 0;) {
+      const size_t src = (z * ownedDims.y + y) * ownedDims.x * voxelSize;
+      const size_t dst = (((z + ghostLower.z) * dims.y + y + ghostLower.y) * dims.x
+          + ghostLower.x) * voxelSize;
+      std::memmove(data.data() + dst, data.data() + src, rowBytes);
+    }
+  }
+}
+
+void exchange_ghosts(std::vector<char> &data, const vec3sz &dims,
+    const vec3sz &ghostLower, const vec3sz &ghostUpper, const vec3sz &brickId,
+    const vec3sz &grid, const size_t voxelSize, MPI_Comm comm)
+{
+  // Messages sent towards the upper neighbor along an axis are tagged 0,
+  // those sent towards the lower neighbor 1
+  const int TAG_UP = 0;
+  const int TAG_DOWN = 1;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    // Along the axes exchanged already the ghost layers are filled and sent
+    // on, along the ones after we only have the owned voxels
+    vec3sz lower, upper;
+    for (size_t i = 0; i < 3; ++i) {
+      lower[i] = i < axis ? 0 : ghostLower[i];
+      upper[i] = i < axis ? dims[i] : dims[i] - ghostUpper[i];
+    }
+
+    std::array<std::vector<char>, 2> sendBufs, recvBufs;
+    std::array<vec3sz, 2> recvLower, recvUpper;
+    std::vector<MPI_Request> requests;
+    requests.reserve(4);
+    for (size_t side = 0; side < 2; ++side) {
+      const bool up = side == 1;
+      const size_t width = up ? ghostUpper[axis] : ghostLower[axis];
+      if (width == 0) {
+        continue;
+      }
+      vec3sz neighbor = brickId;
+      neighbor[axis] = up ? brickId[axis] + 1 : brickId[axis] - 1;
+      const int neighborRank = neighbor.x + grid.x * (neighbor.y + grid.y * neighbor.z);
+
+      // Send the owned layers next to the neighbor, which are its ghost layers
+      vec3sz sendLower = lower;
+      vec3sz sendUpper = upper;
+      if (up) {
+        sendLower[axis] = dims[axis] - ghostUpper[axis] - width;
+        sendUpper[axis] = dims[axis] - ghostUpper[axis];
+      } else {
+        sendLower[axis] = ghostLower[axis];
+        sendUpper[axis] = ghostLower[axis] + width;
+      }
+      pack_box(data, dims, sendLower, sendUpper, voxelSize, sendBufs[side]);
+
+      recvLower[side] = lower;
+      recvUpper[side] = upper;
+      if (up) {
+        recvLower[side][axis] = dims[axis] - width;
+        recvUpper[side][axis] = dims[axis];
+      } else {
+        recvLower[side][axis] = 0;
+        recvUpper[side][axis] = width;
+      }
+      recvBufs[side].resize(sendBufs[side].size());
+
+      requests.push_back(MPI_REQUEST_NULL);
+      MPI_Irecv(recvBufs[side].data(), recvBufs[side].size(), MPI_BYTE, neighborRank,
+          up ? TAG_DOWN : TAG_UP, comm, &requests.back());
+      requests.push_back(MPI_REQUEST_NULL);
+      MPI_Isend(sendBufs[side].data(), sendBufs[side].size(), MPI_BYTE, neighborRank,
+          up ? TAG_UP : TAG_DOWN, comm, &requests.back());
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+
+    for (size_t side = 0; side < 2; ++side) {
+      if (!recvBufs[side].empty()) {
+        unpack_box(recvBufs[side], dims, recvLower[side], recvUpper[side], voxelSize, data);
+      }
+    }
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+#include <mpi.h>
+#include "util.h"
+
+/* Spread the brick of ownedDims voxels out into a brick of dims voxels in
+ * place, with the owned voxels starting at ghostLower. The ghost voxels
+ * around them are left uninitialized.
+ */
+void pad_brick(std::vector<char> &data, const vec3sz &ownedDims,
+    const vec3sz &ghostLower, const vec3sz &dims, const size_t voxelSize);
+
+/* Fill in the ghost voxels of the brick from the voxels owned by the ranks
+ * with the neighboring bricks in the grid, where brick (x, y, z) is owned by
+ * rank x + grid.x * (y + grid.y * z) in comm. The brick has dims voxels, with
+ * ghostLower and ghostUpper ghost layers before and after the owned voxels
+ * along each axis, which must match the layers the neighbors own. The
+ * exchange is done one axis at a time, sending the ghost layers filled along
+ * the previous axes along with the owned voxels, so the edge and corner
+ * ghost voxels are filled without exchanging with the diagonal neighbors.
+ * Every rank in comm with a neighbor must call this together.
+ */
+void exchange_ghosts(std::vector<char> &data, const vec3sz &dims,
+    const vec3sz &ghostLower, const vec3sz &ghostUpper, const vec3sz &brickId,
+    const vec3sz &grid, const size_t voxelSize, MPI_Comm comm);
+
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+#include "load_timings.h"
+
+const char *LOAD_PHASE_NAMES[NUM_LOAD_PHASES] = {
+  "cache", "open", "metadata", "read", "ghosts", "stats", "store", "upload", "commit"
+};
+
+LoadTimings::LoadTimings() : bytesRead(0) {
+  seconds.fill(0.0);
+}
+void LoadTimings::lap(const LoadPhase phase, LoadClock::time_point &start) {
+  using namespace std::chrono;
+  const auto now = LoadClock::now();
+  seconds[phase] += duration_cast<duration<double>>(now - start).count();
+  start = now;
+}
+void LoadTimings::report(MPI_Comm comm) const {
+  int rank = 0;
+  int numRanks = 0;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numRanks);
+
+  // Send the bytes read along with the phase times
+  const size_t stride = NUM_LOAD_PHASES + 1;
+  std::vector<double> local(seconds.begin(), seconds.end());
+  local.push_back(static_cast<double>(bytesRead));
+  std::vector<double> all(rank == 0 ? stride * numRanks : 0);
+  MPI_Gather(local.data(), stride, MPI_DOUBLE, all.data(), stride, MPI_DOUBLE, 0, comm);
+  if (rank != 0) {
+    return;
+  }
+
+  std::printf("%-10s %10s %10s %10s %10s\n", "phase", "min (s)", "max (s)",
+      "mean (s)", "max rank");
+  for (size_t p = 0; p < NUM_LOAD_PHASES; ++p) {
+    double minTime = all[p];
+    double maxTime = all[p];
+    double total = 0.0;
+    int maxRank = 0;
+    for (int r = 0; r < numRanks; ++r) {
+      const double t = all[r * stride + p];
+      minTime = std::min(minTime, t);
+      if (t > maxTime) {
+        maxTime = t;
+        maxRank = r;
+      }
+      total += t;
+    }
+    std::printf("%-10s %10.4f %10.4f %10.4f %10d\n", LOAD_PHASE_NAMES[p],
+        minTime, maxTime, total / numRanks, maxRank);
+  }
+
+  // The read is collective, so the aggregate bandwidth is limited by the
+  // slowest rank's read
+  double totalBytes = 0.0;
+  double maxRead = 0.0;
+  double minBandwidth = -1.0;
+  double maxBandwidth = 0.0;
+  int slowRank = 0;
+  for (int r = 0; r < numRanks; ++r) {
+    const double bytes = all[r * stride + NUM_LOAD_PHASES];
+    const double readTime = all[r * stride + PHASE_READ];
+    totalBytes += bytes;
+    maxRead = std::max(maxRead, readTime);
+    if (readTime > 0.0) {
+      const double bandwidth = bytes * 1e-6 / readTime;
+      if (minBandwidth < 0.0 || bandwidth < minBandwidth) {
+        minBandwidth = bandwidth;
+        slowRank = r;
+      }
+      maxBandwidth = std::max(maxBandwidth, bandwidth);
+    }
+  }
+  if (maxRead > 0.0) {
+    std::printf("Per-rank read bandwidth: min %.2f MB/s (rank %d), max %.2f MB/s\n"
+        "Aggregate read bandwidth: %.2f MB/s (%.2f MB total)\n",
+        minBandwidth, slowRank, maxBandwidth, totalBytes * 1e-6 / maxRead,
+        totalBytes * 1e-6);
+  }
+  std::fflush(stdout);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <mpi.h>
+
+// The phases of loading a volume we time
+enum LoadPhase {
+  // Looking the brick up in the brick cache, including decompressing it
+  PHASE_CACHE,
+  // Opening the PIDX file
+  PHASE_OPEN,
+  // Looking up the variables and computing the brick to read
+  PHASE_METADATA,
+  // Setting up the reads and closing the file, which is where PIDX reads
+  PHASE_READ,
+  // Exchanging ghost voxels with the neighboring ranks
+  PHASE_GHOSTS,
+  // Compacting the brick, reducing its value range and histogram and
+  // converting it to the storage type
+  PHASE_STATS,
+  // Putting the bricks in the brick cache, compressing them if it's
+  // compressed, and writing them to the disk cache
+  PHASE_STORE,
+  // Copying or sharing the brick data with OSPRay
+  PHASE_UPLOAD,
+  // Committing the OSPRay volume
+  PHASE_COMMIT,
+  NUM_LOAD_PHASES
+};
+
+using LoadClock = std::chrono::high_resolution_clock;
+
+/* The time this rank spent in each phase of loading a volume and the bytes
+ * it read from PIDX.
+ */
+struct LoadTimings {
+  std::array<double, NUM_LOAD_PHASES> seconds;
+  size_t bytesRead;
+
+  LoadTimings();
+  // Add the time since start to the phase and restart the timer from now
+  void lap(const LoadPhase phase, LoadClock::time_point &start);
+  /* Gather the timings of all ranks to rank 0 and print the min, max and
+   * mean time of each phase along with the slowest rank, and the per-rank
+   * and aggregate read bandwidth. Collective over comm.
+   */
+  void report(MPI_Comm comm) const;
+};
+
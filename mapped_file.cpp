@@ -0,0 +1,35 @@
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mapped_file.h"
+
+MappedFile::MappedFile(const std::string &path) : ptr(nullptr), bytes(0) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  struct stat fileStat = {0};
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("Failed to stat " + path + " or it's empty");
+  }
+  bytes = fileStat.st_size;
+  void *mapping = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file open, so we don't need the fd anymore
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Failed to map " + path);
+  }
+  ptr = static_cast<char*>(mapping);
+}
+MappedFile::~MappedFile() {
+  munmap(ptr, bytes);
+}
+const char* MappedFile::data() const {
+  return ptr;
+}
+size_t MappedFile::size() const {
+  return bytes;
+}
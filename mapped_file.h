@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+/* A file mapped read-only into memory, unmapped when destroyed. Used to
+ * hand bricks in the disk cache to OSPRay without reading them into memory
+ * first.
+ */
+class MappedFile {
+  char *ptr;
+  size_t bytes;
+
+public:
+  // Map the file at path, throws if it can't be opened or mapped
+  MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile& operator=(const MappedFile &) = delete;
+
+  const char* data() const;
+  size_t size() const;
+};
+
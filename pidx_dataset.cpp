@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "pidx_dataset.h"
+
+PIDXIOSettings::PIDXIOSettings()
+  : aggregatorMultiplier(0), partitionCount(0), restructuringBox(0)
+{}
+std::ostream& operator<<(std::ostream &os, const PIDXIOSettings &s) {
+  os << "{aggregator multiplier: " << s.aggregatorMultiplier
+    << ", partition count: " << s.partitionCount
+    << ", restructuring box: " << s.restructuringBox << "}";
+  return os;
+}
+void load_io_config(const std::string &path, PIDXIOSettings &settings) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    throw std::runtime_error("Failed to open I/O config file " + path);
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream in(line);
+    std::string name;
+    if (!(in >> name) || name[0] == '#') {
+      continue;
+    }
+    bool ok = false;
+    if (name == "aggregator_multiplier") {
+      ok = static_cast<bool>(in >> settings.aggregatorMultiplier);
+    } else if (name == "partition_count") {
+      ok = static_cast<bool>(in >> settings.partitionCount.x
+          >> settings.partitionCount.y >> settings.partitionCount.z);
+    } else if (name == "restructuring_box") {
+      ok = static_cast<bool>(in >> settings.restructuringBox.x
+          >> settings.restructuringBox.y >> settings.restructuringBox.z);
+    }
+    if (!ok) {
+      throw std::runtime_error("Invalid I/O config line '" + line + "' in " + path);
+    }
+  }
+}
+
+PIDXDataset::PIDXDataset(MPI_Comm comm)
+  : comm(comm), roi(ospcommon::vec3f(0.f), ospcommon::vec3f(1.f)),
+  storage(STORE_NATIVE), level(0), refinement(2), ghosts(1)
+{
+  PIDX_CHECK(PIDX_create_access(&access));
+  PIDX_CHECK(PIDX_set_mpi_access(access, comm));
+}
+PIDXDataset::~PIDXDataset() {
+  PIDX_close_access(access);
+}
+PIDX_file PIDXDataset::open(const std::string &path, const size_t timestep,
+    vec3sz &dims)
+{
+  PIDX_file file;
+  PIDX_point pdims;
+  PIDX_CHECK(PIDX_file_open(path.c_str(), PIDX_MODE_RDONLY, access, pdims, &file));
+  PIDX_CHECK(PIDX_set_current_time_step(file, timestep));
+  if (io.aggregatorMultiplier > 0) {
+    PIDX_CHECK(PIDX_set_aggregator_multiplier(file, io.aggregatorMultiplier));
+  }
+  if (io.partitionCount.x > 0) {
+    PIDX_CHECK(PIDX_set_partition_count(file, io.partitionCount.x,
+          io.partitionCount.y, io.partitionCount.z));
+  }
+  if (io.restructuringBox.x > 0) {
+    PIDX_point box;
+    PIDX_set_point(box, io.restructuringBox.x, io.restructuringBox.y,
+        io.restructuringBox.z);
+    PIDX_CHECK(PIDX_set_restructuring_box(file, box));
+  }
+  dims = vec3sz(pdims[0], pdims[1], pdims[2]);
+
+  if (variables.empty()) {
+    int variableCount = 0;
+    PIDX_CHECK(PIDX_get_variable_count(file, &variableCount));
+
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0) {
+      std::cout << "Variable count = " << variableCount << "\n";
+    }
+
+    for (int i = 0; i < variableCount; ++i) {
+      PIDX_CHECK(PIDX_set_current_variable_index(file, i));
+      PIDX_variable variable;
+      PIDX_CHECK(PIDX_get_current_variable(file, &variable));
+      variables.push_back(variable->var_name);
+      variableTypes.push_back(variable->type_name);
+    }
+  }
+  return file;
+}
+const std::vector<std::string>& PIDXDataset::variableNames() const {
+  return variables;
+}
+int PIDXDataset::variableIndex(const std::string &name) const {
+  auto v = std::find(variables.begin(), variables.end(), name);
+  if (v == variables.end()) {
+    return -1;
+  }
+  return std::distance(variables.begin(), v);
+}
+const std::string& PIDXDataset::variableType(const int index) const {
+  return variableTypes.at(index);
+}
+MPI_Comm PIDXDataset::communicator() const {
+  return comm;
+}
+
+void PIDXDataset::setRegionOfInterest(const ospcommon::box3f &region) {
+  roi = region;
+}
+void PIDXDataset::regionOfInterest(const vec3sz &dims, vec3sz &offset,
+    vec3sz &size) const
+{
+  for (size_t i = 0; i < 3; ++i) {
+    const float lower = std::max(0.f, std::min(roi.lower[i], roi.upper[i]));
+    const float upper = std::min(1.f, std::max(roi.lower[i], roi.upper[i]));
+    offset[i] = std::min(static_cast<size_t>(std::floor(lower * dims[i])), dims[i] - 1);
+    const size_t end = std::max(static_cast<size_t>(std::ceil(upper * dims[i])),
+        offset[i] + 1);
+    size[i] = std::min(end, dims[i]) - offset[i];
+  }
+}
+const ospcommon::box3f& PIDXDataset::normalizedRegionOfInterest() const {
+  return roi;
+}
+void PIDXDataset::setVoxelStorage(const VoxelStorage s) {
+  storage = s;
+}
+VoxelStorage PIDXDataset::voxelStorage() const {
+  return storage;
+}
+void PIDXDataset::setIOSettings(const PIDXIOSettings &settings) {
+  io = settings;
+}
+const PIDXIOSettings& PIDXDataset::ioSettings() const {
+  return io;
+}
+void PIDXDataset::setAMRLevel(const int l) {
+  level = l;
+}
+int PIDXDataset::amrLevel() const {
+  return level;
+}
+void PIDXDataset::setAMRRefinement(const int r) {
+  refinement = r;
+}
+int PIDXDataset::amrRefinement() const {
+  return refinement;
+}
+void PIDXDataset::setGhostWidth(const int width) {
+  ghosts = std::max(width, 1);
+}
+int PIDXDataset::ghostWidth() const {
+  return ghosts;
+}
+void PIDXDataset::setDiskCache(const std::shared_ptr<DiskBrickCache> &cache) {
+  disk = cache;
+}
+DiskBrickCache* PIDXDataset::diskCache() const {
+  return disk.get();
+}
+void PIDXDataset::copySettings(const PIDXDataset &other) {
+  roi = other.roi;
+  storage = other.storage;
+  io = other.io;
+  level = other.level;
+  refinement = other.refinement;
+  ghosts = other.ghosts;
+  disk = other.disk;
+}
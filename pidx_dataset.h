@@ -0,0 +1,132 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include "util.h"
+#include "pidx_util.h"
+#include "disk_cache.h"
+#include "PIDX.h"
+
+// How to store the voxels of floating point variables once they're read
+enum VoxelStorage {
+  // Keep the type the variable is stored as in the dataset
+  STORE_NATIVE,
+  // Convert double precision variables to float
+  STORE_FLOAT,
+  // Quantize floating point variables to 16 bit ints over their value range
+  STORE_U16,
+};
+
+/* Tuning parameters for how PIDX reads files, which have a big effect on
+ * read performance. Parameters left at zero use the library's defaults.
+ */
+struct PIDXIOSettings {
+  // Scales the number of aggregator ranks PIDX reads the file with
+  int aggregatorMultiplier;
+  // The number of partitions along each axis PIDX splits the ranks into
+  ospcommon::vec3i partitionCount;
+  // The size of the boxes PIDX restructures the data into between ranks
+  ospcommon::vec3i restructuringBox;
+
+  PIDXIOSettings();
+};
+
+std::ostream& operator<<(std::ostream &os, const PIDXIOSettings &s);
+
+/* Load I/O settings from a config file with one setting per line, e.g.
+ *   aggregator_multiplier 2
+ *   partition_count 2 2 1
+ *   restructuring_box 64 64 64
+ * Lines starting with # are ignored. The settings not in the file are left
+ * as they are in settings.
+ */
+void load_io_config(const std::string &path, PIDXIOSettings &settings);
+
+/* A PIDX dataset session kept open across timestep and variable switches.
+ * It holds on to the PIDX access handle and the dataset's variables and their
+ * types, so switching timesteps or variables doesn't look them up again.
+ * PIDX only reads a file's data when it's closed, so each read still opens
+ * the file and parses its IDX header, the file handles can't be kept open
+ * between reads. Opening files is collective over the session's
+ * communicator, and a session should only be used by one thread.
+ */
+class PIDXDataset {
+  MPI_Comm comm;
+  PIDX_access access;
+  // The variables are the same in each timestep's file, so we only look them
+  // up from the first file we open
+  std::vector<std::string> variables;
+  std::vector<std::string> variableTypes;
+  // The part of the volume to read, normalized over the volume
+  ospcommon::box3f roi;
+  VoxelStorage storage;
+  PIDXIOSettings io;
+  std::shared_ptr<DiskBrickCache> disk;
+  // The AMR level to load and the refinement between levels
+  int level, refinement;
+  int ghosts;
+
+public:
+  PIDXDataset(MPI_Comm comm = MPI_COMM_WORLD);
+  ~PIDXDataset();
+  PIDXDataset(const PIDXDataset &) = delete;
+  PIDXDataset& operator=(const PIDXDataset &) = delete;
+
+  /* Open the file at path for reading the timestep, returning the
+   * dimensions of the volume in dims. The caller must close the file with
+   * PIDX_close, which does the actual reads, so every read opens the file
+   * again.
+   */
+  PIDX_file open(const std::string &path, const size_t timestep, vec3sz &dims);
+  // The variables in the dataset, empty until a file has been opened
+  const std::vector<std::string>& variableNames() const;
+  // Get the index of the variable, or -1 if there's no such variable
+  int variableIndex(const std::string &name) const;
+  // Get the IDX type name of the variable
+  const std::string& variableType(const int index) const;
+  MPI_Comm communicator() const;
+  /* Set the region of the volume to read, normalized to [0, 1] over the
+   * volume. Volumes read through the session only load this part of the
+   * volume, by default the whole volume is read.
+   */
+  void setRegionOfInterest(const ospcommon::box3f &region);
+  /* Get the offset and size of the region of interest in voxels for a volume
+   * with dims voxels. The region is at least one voxel along each axis.
+   */
+  void regionOfInterest(const vec3sz &dims, vec3sz &offset, vec3sz &size) const;
+  const ospcommon::box3f& normalizedRegionOfInterest() const;
+  // Set how volumes read through the session store their voxels
+  void setVoxelStorage(const VoxelStorage storage);
+  VoxelStorage voxelStorage() const;
+  // Set the PIDX tuning parameters used for files opened after this
+  void setIOSettings(const PIDXIOSettings &settings);
+  const PIDXIOSettings& ioSettings() const;
+  /* Set the Uintah AMR level to load, callers pick the timestep's file for
+   * it with UintahTimestep::levelPath. Volumes of a refined level read the
+   * coarser levels' files next to it to fill in where it isn't refined.
+   */
+  void setAMRLevel(const int level);
+  int amrLevel() const;
+  // Set how many times finer each AMR level is than the one before along
+  // each axis, 2 by default
+  void setAMRRefinement(const int refinement);
+  int amrRefinement() const;
+  /* Set how many layers of ghost voxels bricks read through the session
+   * share with their neighbors, 1 by default. Wider layers are needed for
+   * gradient shading. Only full resolution reads get wider layers, the
+   * width is at least 1 and limited by the size of the bricks.
+   */
+  void setGhostWidth(const int width);
+  int ghostWidth() const;
+  // Set the node-local disk cache volumes read through the session keep
+  // their bricks in, or null to not use one
+  void setDiskCache(const std::shared_ptr<DiskBrickCache> &cache);
+  DiskBrickCache* diskCache() const;
+  // Read with the same region of interest, voxel storage, I/O settings, AMR
+  // level, ghost width and disk cache as the other session
+  void copySettings(const PIDXDataset &other);
+};
+
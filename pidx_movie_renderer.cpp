@@ -18,6 +18,7 @@
 #include "pidx_util.h"
 #include "image_util.h"
 #include "pidx_volume.h"
+#include "timestep_manifest.h"
 
 using namespace ospcommon;
 using namespace ospray::cpp;
@@ -33,6 +34,7 @@ int main(int argc, char **argv) {
   vec2i fbSize(1080, 1920);
   std::string datasetPath;
   std::vector<std::string> timestepDirs;
+  std::string timestepManifest;
   std::string outputPrefix = "frame";
   size_t framesPerTimestep = 2;
   std::string variableName;
@@ -43,6 +45,8 @@ int main(int argc, char **argv) {
       outputPrefix = argv[++i];
     } else if (std::strcmp("-variable", argv[i]) == 0) {
       variableName = std::string(argv[++i]);
+    } else if (std::strcmp("-timestep-manifest", argv[i]) == 0) {
+      timestepManifest = argv[++i];
     } else if (std::strcmp("-timesteps", argv[i]) == 0) {
       for (; i + 1 < argc; ++i) {
         if (argv[i + 1][0] == '-') {
@@ -58,6 +62,7 @@ int main(int argc, char **argv) {
         "Options:\n"
         "-dataset <dataset.idx>       Specify the IDX datset to load and render\n"
         "-timesteps <dir>             Specify the directory containing Uintah timesteps\n"
+        "-timestep-manifest <file>    Cache the list of Uintah timesteps in the file\n"
         );
   }
 
@@ -105,16 +110,20 @@ int main(int argc, char **argv) {
   if (datasetPath.empty()) {
     // Follow the Uintah directory structure for PIDX to the CCVars.idx for
     // the timestep
-    uintahTimesteps = collectUintahTimesteps(timestepDirs);
-    std::cout << "Read " << uintahTimesteps.size() << " timestep dirs" << std::endl;
+    uintahTimesteps = share_uintah_timesteps(timestepDirs, MPI_COMM_WORLD,
+        timestepManifest);
+    if (rank == 0) {
+      std::cout << "Read " << uintahTimesteps.size() << " timestep dirs" << std::endl;
+    }
     currentTimestep = uintahTimesteps.cbegin();
     datasetPath = currentTimestep->path;
     std::cout << "dataset for first timestep = " << datasetPath
       << ", timestep = " << currentTimestep->timestep << std::endl;
   }
-  auto pidxVolume = std::make_shared<PIDXVolume>(datasetPath, tfcn,
+  auto dataset = ospcommon::make_unique<PIDXDataset>(MPI_COMM_WORLD);
+  auto pidxVolume = std::make_shared<PIDXVolume>(*dataset, datasetPath, tfcn,
       variableName, currentTimestep->timestep);
-  pidxVolume->volume.commit();
+  pidxVolume->upload();
   // TODO: Update based on volume
   box3f worldBounds(vec3f(-64), vec3f(64));
 
@@ -161,8 +170,9 @@ int main(int argc, char **argv) {
         std::cout << "dataset for timestep  = " << datasetPath << std::endl;
 
         model.removeVolume(pidxVolume->volume);
-        pidxVolume = std::make_shared<PIDXVolume>(datasetPath, tfcn,
+        pidxVolume = std::make_shared<PIDXVolume>(*dataset, datasetPath, tfcn,
             variableName, currentTimestep->timestep);
+        pidxVolume->upload();
         model.addVolume(pidxVolume->volume);
         model.commit();
       }
@@ -209,6 +219,7 @@ int main(int argc, char **argv) {
     std::cout << "Avg. frame time: " << avgFrameTime / nframes << "s\n";
   }
   pidxVolume = nullptr;
+  dataset = nullptr;
   tfcn.release();
   model.release();
   renderer.release();
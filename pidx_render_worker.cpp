@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <array>
 #include <chrono>
+#include <sstream>
 #include <mpiCommon/MPICommon.h>
 #include <mpi.h>
 #include <unistd.h>
@@ -20,7 +21,11 @@
 #include "pidx_util.h"
 #include "image_util.h"
 #include "pidx_volume.h"
+#include "timestep_manifest.h"
 #include "client_server.h"
+#include "timestep_loader.h"
+#include "frame_controller.h"
+#include "frame_state.h"
 
 using namespace ospcommon;
 using namespace ospray::cpp;
@@ -28,13 +33,32 @@ using namespace ospray::cpp;
 int main(int argc, char **argv) {
   int provided = 0;
   int port = -1;
-  // TODO: OpenMPI sucks as always and doesn't support pt2pt one-sided
-  // communication with thread multiple. This can trigger a hang in OSPRay
-  // if you're not using OpenMPI you can change this to MPI_THREAD_MULTIPLE
-  MPI_Init_thread(&argc, &argv, MPI_THREAD_SINGLE, &provided);
+  size_t prefetchTimesteps = 0;
+  size_t cacheMB = 0;
+  int progressiveLevels = 0;
+  bool shareBricks = false;
+  bool compressCache = false;
+  std::vector<std::string> variables;
+  VoxelStorage storage = STORE_NATIVE;
+  std::string ioConfig;
+  std::string diskCacheDir;
+  int amrRefinement = 2;
+  int amrMaxLevel = -1;
+  // Refined AMR levels are read into one dense brick per rank at the level's
+  // resolution, so don't pick a level whose bricks would be bigger than this
+  size_t amrBrickMB = 2048;
+  int ghostWidth = 1;
+  float varianceThreshold = 0.01f;
+  float interactionScale = 0.5f;
+  int stillMs = 200;
+  float targetFps = 0.f;
+  // I/O settings from the command line, which override the config file's
+  PIDXIOSettings ioOverrides;
+  bool ioAutotune = false;
 
   std::string datasetPath;
   std::vector<std::string> timestepDirs;
+  std::string timestepManifest;
   AppState app;
   AppData appdata;
 
@@ -45,8 +69,71 @@ int main(int argc, char **argv) {
       port = std::atoi(argv[++i]);
     } else if (std::strcmp("-timestep", argv[i]) == 0) {
       app.currentTimestep = std::atoll(argv[++i]);
+    } else if (std::strcmp("-prefetch", argv[i]) == 0) {
+      prefetchTimesteps = std::atoll(argv[++i]);
+    } else if (std::strcmp("-cache-mb", argv[i]) == 0) {
+      cacheMB = std::atoll(argv[++i]);
+    } else if (std::strcmp("-progressive", argv[i]) == 0) {
+      progressiveLevels = std::atoi(argv[++i]);
+    } else if (std::strcmp("-shared-volume", argv[i]) == 0) {
+      shareBricks = true;
+    } else if (std::strcmp("-compress-cache", argv[i]) == 0) {
+      compressCache = true;
+    } else if (std::strcmp("-amr-refinement", argv[i]) == 0) {
+      amrRefinement = std::atoi(argv[++i]);
+    } else if (std::strcmp("-amr-max-level", argv[i]) == 0) {
+      amrMaxLevel = std::atoi(argv[++i]);
+    } else if (std::strcmp("-amr-brick-mb", argv[i]) == 0) {
+      amrBrickMB = std::atoll(argv[++i]);
+    } else if (std::strcmp("-ghost-width", argv[i]) == 0) {
+      ghostWidth = std::atoi(argv[++i]);
+    } else if (std::strcmp("-variance-threshold", argv[i]) == 0) {
+      varianceThreshold = std::atof(argv[++i]);
+    } else if (std::strcmp("-interaction-scale", argv[i]) == 0) {
+      interactionScale = std::atof(argv[++i]);
+    } else if (std::strcmp("-still-ms", argv[i]) == 0) {
+      stillMs = std::atoi(argv[++i]);
+    } else if (std::strcmp("-target-fps", argv[i]) == 0) {
+      targetFps = std::atof(argv[++i]);
+    } else if (std::strcmp("-disk-cache", argv[i]) == 0) {
+      diskCacheDir = argv[++i];
+    } else if (std::strcmp("-io-config", argv[i]) == 0) {
+      ioConfig = argv[++i];
+    } else if (std::strcmp("-io-aggregator-multiplier", argv[i]) == 0) {
+      ioOverrides.aggregatorMultiplier = std::atoi(argv[++i]);
+    } else if (std::strcmp("-io-partitions", argv[i]) == 0) {
+      for (size_t j = 0; j < 3; ++j) {
+        ioOverrides.partitionCount[j] = std::atoi(argv[++i]);
+      }
+    } else if (std::strcmp("-io-restructuring-box", argv[i]) == 0) {
+      for (size_t j = 0; j < 3; ++j) {
+        ioOverrides.restructuringBox[j] = std::atoi(argv[++i]);
+      }
+    } else if (std::strcmp("-io-autotune", argv[i]) == 0) {
+      ioAutotune = true;
+    } else if (std::strcmp("-store-as", argv[i]) == 0) {
+      ++i;
+      if (std::strcmp("float", argv[i]) == 0) {
+        storage = STORE_FLOAT;
+      } else if (std::strcmp("u16", argv[i]) == 0) {
+        storage = STORE_U16;
+      } else {
+        std::cerr << "Unknown -store-as type " << argv[i]
+          << ", expected float or u16\n";
+        return 1;
+      }
     } else if (std::strcmp("-variable", argv[i]) == 0) {
       appdata.currentVariable = std::string(argv[++i]);
+    } else if (std::strcmp("-variables", argv[i]) == 0) {
+      std::stringstream list(argv[++i]);
+      std::string v;
+      while (std::getline(list, v, ',')) {
+        if (!v.empty()) {
+          variables.push_back(v);
+        }
+      }
+    } else if (std::strcmp("-timestep-manifest", argv[i]) == 0) {
+      timestepManifest = argv[++i];
     } else if (std::strcmp("-timesteps", argv[i]) == 0) {
       for (; i + 1 < argc; ++i) {
         if (argv[i + 1][0] == '-') {
@@ -61,11 +148,83 @@ int main(int argc, char **argv) {
       << "Options:\n"
       << "-dataset <dataset.idx>\n"
       << "-timesteps [list of timestep dirs]\n"
+      << "-timestep-manifest <file>\n"
+      << "                   Cache the list of timesteps found in the timestep dirs\n"
+      << "                   in the file, rescanning when the dirs change\n"
       << "-port <port>\n"
       << "-timestep <timestep>\n"
-      << "-variable <variable>";
+      << "-variable <variable>\n"
+      << "-variables <a,b,c> Read these variables together for each timestep and\n"
+      << "                   keep them cached for switching between, needs -cache-mb\n"
+      << "-prefetch <N>      Number of timesteps to load ahead while scrubbing\n"
+      << "-cache-mb <MB>     Per-rank memory budget for caching loaded bricks\n"
+      << "-compress-cache    Keep the cached bricks compressed in memory\n"
+      << "-amr-max-level <N> Load at most up to this AMR level of Uintah timesteps,\n"
+      << "                   the level loaded is picked to match the view\n"
+      << "-amr-refinement <N>\n"
+      << "                   The refinement ratio between AMR levels, 2 by default\n"
+      << "-amr-brick-mb <MB> Per-rank memory budget for the brick of a refined AMR\n"
+      << "                   level, finer levels are skipped, 2048 by default\n"
+      << "-ghost-width <N>   Layers of ghost voxels shared between neighboring\n"
+      << "                   bricks, 1 by default, wider for gradient shading\n"
+      << "-variance-threshold <V>\n"
+      << "                   Stop rendering once the image's variance is below V\n"
+      << "                   until something changes, 0.01 by default, 0 to disable\n"
+      << "-interaction-scale <S>\n"
+      << "                   Render at S times the window's resolution while the\n"
+      << "                   camera is moving, 0.5 by default, 1 to disable\n"
+      << "-still-ms <ms>     How long the camera must be still before rendering at\n"
+      << "                   full resolution again, 200ms by default\n"
+      << "-target-fps <FPS>  Adjust the resolution, passes per frame and sampling\n"
+      << "                   rate each frame to render at about FPS frames per\n"
+      << "                   second, replacing -interaction-scale\n"
+      << "-disk-cache <dir>  Keep loaded bricks in the directory on node-local\n"
+      << "                   storage and map them back in when restarted\n"
+      << "-progressive <N>   Start by reading the volume with the N finest HZ levels\n"
+      << "                   skipped, then refine it in the background\n"
+      << "-shared-volume     Render directly from the loaded bricks instead of\n"
+      << "                   copying them into OSPRay\n"
+      << "-store-as <type>   Convert floating point variables to float or quantize\n"
+      << "                   them to u16 over their value range when loading\n"
+      << "-io-config <file>  Load PIDX I/O settings from the file\n"
+      << "-io-aggregator-multiplier <N>\n"
+      << "-io-partitions <x> <y> <z>\n"
+      << "-io-restructuring-box <x> <y> <z>\n"
+      << "                   Set PIDX I/O settings, overriding the config file\n"
+      << "-io-autotune       Try different PIDX I/O settings reading the first\n"
+      << "                   timestep and keep the fastest";
     return 1;
   }
+  if (!variables.empty()) {
+    if (cacheMB == 0) {
+      std::cerr << "-variables needs a brick cache to keep the variables in, "
+        "set its size with -cache-mb\n";
+      return 1;
+    }
+    if (appdata.currentVariable.empty()) {
+      appdata.currentVariable = variables[0];
+    }
+  }
+
+  // Rank 0 always sends frames to the viewer on a thread of its own, which
+  // makes no MPI calls, so we need at least funneled. Prefetching and
+  // progressive refinement do their collective reads on a background thread,
+  // so they need thread multiple, though some MPIs (e.g. OpenMPI) can hang in
+  // OSPRay's one-sided communication with it, so we only ask for it then.
+  const bool backgroundLoads = prefetchTimesteps > 0 || progressiveLevels > 0;
+  const int threadLevel = backgroundLoads ? MPI_THREAD_MULTIPLE : MPI_THREAD_FUNNELED;
+  MPI_Init_thread(&argc, &argv, threadLevel, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    std::cerr << "MPI_THREAD_FUNNELED is not supported, but rank 0 needs it "
+      "to send frames on a separate thread\n";
+    MPI_Finalize();
+    return 1;
+  }
+  if (backgroundLoads && provided < MPI_THREAD_MULTIPLE) {
+    std::cerr << "MPI_THREAD_MULTIPLE is not supported, disabling prefetching "
+      "and refining between frames instead\n";
+    prefetchTimesteps = 0;
+  }
 
   ospLoadModule("mpi");
   Device device("mpi_distributed");
@@ -80,7 +239,7 @@ int main(int argc, char **argv) {
   if (rank == 0) {
     char hostname[1024] = {0};
     gethostname(hostname, 1023);
-    std::cout << "Now listening for client on " << hostname << ":" << port << std::endl;
+    std::cout << "Now listening for clients on " << hostname << ":" << port << std::endl;
     client = ospcommon::make_unique<ClientConnection>(port);
   }
 
@@ -103,6 +262,8 @@ int main(int argc, char **argv) {
     opacityData.commit();
     tfcn.set("colors", colorsData);
     tfcn.set("opacities", opacityData);
+    appdata.tfcn_colors = colors;
+    appdata.tfcn_alphas = opacities;
   }
 
   Model model;
@@ -111,8 +272,11 @@ int main(int argc, char **argv) {
   if (datasetPath.empty()) {
     // Follow the Uintah directory structure for PIDX to the CCVars.idx for
     // the timestep
-    uintahTimesteps = collectUintahTimesteps(timestepDirs);
-    std::cout << "Read " << uintahTimesteps.size() << " timestep dirs" << std::endl;
+    uintahTimesteps = share_uintah_timesteps(timestepDirs, MPI_COMM_WORLD,
+        timestepManifest);
+    if (rank == 0) {
+      std::cout << "Read " << uintahTimesteps.size() << " timestep dirs" << std::endl;
+    }
     auto t = uintahTimesteps.begin();
     datasetPath = t->path;
     app.currentTimestep = t->timestep;
@@ -120,18 +284,121 @@ int main(int argc, char **argv) {
       << ", timestep = " << app.currentTimestep << std::endl;
   }
 
-  auto pidxVolume = std::make_shared<PIDXVolume>(datasetPath, tfcn,
-      appdata.currentVariable, app.currentTimestep);
+  std::unique_ptr<BrickCache> brickCache;
+  if (cacheMB > 0) {
+    brickCache = ospcommon::make_unique<BrickCache>(cacheMB * 1000000,
+        compressCache);
+  }
+
+  // Keep the dataset session open for the synchronous reads on this thread
+  auto dataset = ospcommon::make_unique<PIDXDataset>(MPI_COMM_WORLD);
+  dataset->setVoxelStorage(storage);
+  dataset->setAMRRefinement(amrRefinement);
+  dataset->setGhostWidth(ghostWidth);
+  {
+    PIDXIOSettings io;
+    if (!ioConfig.empty()) {
+      load_io_config(ioConfig, io);
+    }
+    if (ioOverrides.aggregatorMultiplier > 0) {
+      io.aggregatorMultiplier = ioOverrides.aggregatorMultiplier;
+    }
+    if (ioOverrides.partitionCount.x > 0) {
+      io.partitionCount = ioOverrides.partitionCount;
+    }
+    if (ioOverrides.restructuringBox.x > 0) {
+      io.restructuringBox = ioOverrides.restructuringBox;
+    }
+    dataset->setIOSettings(io);
+    if (ioAutotune) {
+      autotune_io_settings(*dataset, datasetPath, tfcn, appdata.currentVariable,
+          app.currentTimestep);
+    }
+  }
+  // Set up the disk cache after autotuning so the trial reads go to PIDX
+  if (!diskCacheDir.empty()) {
+    dataset->setDiskCache(std::make_shared<DiskBrickCache>(diskCacheDir));
+  }
+  auto pidxVolume = std::make_shared<PIDXVolume>(*dataset, datasetPath, tfcn,
+      appdata.currentVariable, app.currentTimestep, brickCache.get(),
+      progressiveLevels, variables);
+  pidxVolume->upload(shareBricks);
+
+  std::unique_ptr<TimestepLoader> loader;
+  auto startLoader = [&]() {
+    if (provided == MPI_THREAD_MULTIPLE
+        && ((prefetchTimesteps > 0 && uintahTimesteps.size() > 1) || progressiveLevels > 0))
+    {
+      loader = ospcommon::make_unique<TimestepLoader>(uintahTimesteps, tfcn,
+          prefetchTimesteps, MPI_COMM_WORLD, brickCache.get(), progressiveLevels,
+          variables, dataset.get());
+      loader->prefetch(app.currentTimestep, 1, appdata.currentVariable);
+    }
+  };
+  startLoader();
+
+  // Each refinement pass reads this many more HZ levels, halving the sample
+  // spacing along each axis
+  const int refinementLevels = 3;
+  auto nextRefinement = [&]() {
+    const int coarsenLevels = pidxVolume->maxResolution - pidxVolume->resolution;
+    return std::max(coarsenLevels - refinementLevels, 0);
+  };
+  auto startRefinement = [&]() {
+    if (!loader) {
+      return;
+    }
+    if (pidxVolume->resolution < pidxVolume->maxResolution) {
+      loader->refine(datasetPath, app.currentTimestep, appdata.currentVariable,
+          nextRefinement());
+    } else {
+      loader->cancelRefinement();
+    }
+  };
+  startRefinement();
   // TODO: Update based on volume
   box3f worldBounds(vec3f(-64), vec3f(64));
 
-  std::vector<box3f> regions{pidxVolume->localRegion};
-  ospray::cpp::Data regionData(regions.size() * 2, OSP_FLOAT3, regions.data());
-  model.set("regions", regionData);
-  model.addVolume(pidxVolume->volume);
-  model.commit();
+  /* Only render the part of our region which isn't transparent under the
+   * transfer function, dropping out of the render entirely if our whole
+   * brick is transparent. The model commit is collective, so all ranks must
+   * call this together.
+   */
+  bool volumeInModel = false;
+  auto updateRegions = [&]() {
+    box3f visible;
+    const bool anyVisible = pidxVolume->visibleRegion(appdata.tfcn_alphas, visible);
+    // OSPRay doesn't reliably take an empty data array, so a transparent rank
+    // sets a degenerate region at its brick origin to replace any stale box
+    // from before, and drops its volume from the model
+    if (!anyVisible) {
+      visible = box3f(pidxVolume->localRegion.lower, pidxVolume->localRegion.lower);
+    }
+    ospray::cpp::Data regionData(2, OSP_FLOAT3, &visible);
+    model.set("regions", regionData);
+    if (anyVisible && !volumeInModel) {
+      model.addVolume(pidxVolume->volume);
+      volumeInModel = true;
+    } else if (!anyVisible && volumeInModel) {
+      model.removeVolume(pidxVolume->volume);
+      volumeInModel = false;
+    }
+    model.commit();
+
+    int visibleRanks = anyVisible ? 1 : 0;
+    int totalVisible = 0;
+    MPI_Reduce(&visibleRanks, &totalVisible, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+      std::cout << totalVisible << " of " << worldSize
+        << " ranks have visible data\n";
+    }
+  };
+  updateRegions();
 
+  // The AMR level picked for the view depends on the camera's field of view
+  const float cameraFovy = 60.f;
   Camera camera("perspective");
+  camera.set("fovy", cameraFovy);
   camera.set("pos", vec3f(0, 0, -500));
   camera.set("dir", vec3f(0, 0, 1));
   camera.set("up", vec3f(0, 1, 0));
@@ -148,70 +415,269 @@ int main(int argc, char **argv) {
   FrameBuffer fb(app.fbSize, OSP_FB_SRGBA, OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
   fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
 
+  /* While the camera is moving we render into a smaller framebuffer and the
+   * viewer scales it up, switching back to the full resolution one once the
+   * camera has been still for stillMs. With a target frame rate the
+   * controller picks the scale for every frame instead.
+   */
+  std::unique_ptr<FrameRateController> frameController;
+  if (targetFps > 0.f) {
+    frameController = ospcommon::make_unique<FrameRateController>(targetFps);
+  }
+  FrameSettings frameSettings;
+  const bool scaleInteraction = !frameController
+    && interactionScale > 0.f && interactionScale < 1.f;
+  auto scaledSize = [&](const float scale) {
+    return max(vec2i(vec2f(app.fbSize) * scale), vec2i(1));
+  };
+  vec2i scaledFbSize = scaledSize(interactionScale);
+  FrameBuffer scaledFb(scaledFbSize, OSP_FB_SRGBA,
+      OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+  scaledFb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+  auto clearFrame = [&]() {
+    fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+    scaledFb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+  };
+  // Volumes are created with OSPRay's default sampling rate, which only
+  // changes with a target frame rate
+  auto applySamplingRate = [&]() {
+    if (frameController) {
+      pidxVolume->volume.set("samplingRate", frameSettings.samplingRate);
+      pidxVolume->volume.commit();
+    }
+  };
+  bool interacting = false;
+  // Only rank 0 tracks time since the camera last moved and decides for everyone
+  std::chrono::steady_clock::time_point lastCameraChange;
+
+  // Swap a newly loaded volume in to the model in place of the current one
+  bool volumeChanged = false;
+  auto swapVolume = [&](const std::shared_ptr<PIDXVolume> &next) {
+    if (volumeInModel) {
+      model.removeVolume(pidxVolume->volume);
+      volumeInModel = false;
+    }
+    pidxVolume = next;
+    pidxVolume->upload(shareBricks);
+    applySamplingRate();
+    updateRegions();
+    clearFrame();
+    volumeChanged = true;
+  };
+
+  // Rank 0 sends each frame while we all render the next one
+  std::unique_ptr<FrameSender> frameSender;
   if (rank == 0) {
-    client->send_metadata(pidxVolume->pidxVars, uintahTimesteps,
-        appdata.currentVariable, app.currentTimestep);
+    frameSender = ospcommon::make_unique<FrameSender>(*client);
   }
+  auto stateBroadcast = ospcommon::make_unique<FrameStateBroadcast>(MPI_COMM_WORLD);
+  FrameState frameState;
 
   mpicommon::world.barrier();
 
+  // Get the number of AMR levels we can load for the current timestep
+  auto amrLevelCount = [&]() {
+    auto t = uintahTimesteps.find(UintahTimestep(app.currentTimestep, ""));
+    if (t == uintahTimesteps.end()) {
+      return 1;
+    }
+    const int levels = t->levels.size();
+    return amrMaxLevel >= 0 ? std::min(levels, amrMaxLevel + 1) : levels;
+  };
+  // Find the finest AMR level whose bricks fit in the budget. The refined
+  // bricks cover the whole region of interest at the level's resolution, so
+  // we scale up the current volume's region to each level to estimate them
+  auto amrLevelInBudget = [&]() {
+    vec3sz roiOffset, roiDims;
+    dataset->regionOfInterest(pidxVolume->fullDims, roiOffset, roiDims);
+    const size_t voxelSize = voxel_size(pidxVolume->voxelType);
+    // The region's size in level 0 voxels
+    const vec3f roiExtent = vec3f(roiDims) * pidxVolume->levelSpacing;
+    const int levels = amrLevelCount();
+    int level = 0;
+    float scale = amrRefinement;
+    for (int l = 1; l < levels; ++l, scale *= amrRefinement) {
+      const vec3f dims = roiExtent * scale;
+      const double brickBytes = static_cast<double>(dims.x) * dims.y * dims.z
+        * voxelSize / worldSize;
+      if (brickBytes > amrBrickMB * 1e6) {
+        break;
+      }
+      level = l;
+    }
+    return level;
+  };
+  int nextAMRLevel = 0;
+  // The last level we warned about skipping, so we don't repeat it every frame
+  int amrBudgetWarned = -1;
+  bool amrLevelChanged = false;
+  // Once the image has converged, or while no viewer is connected, we stop
+  // rendering and sleep until the viewer changes something. We start out
+  // idle until the first viewer connects.
+  bool idle = true;
+  // Only rank 0 talks to the viewer, through the frame sender
+  bool viewerConnected = false;
+
   while (!app.quit) {
     using namespace std::chrono;
 
+    // Be ready for rank 0's state for the next frame as soon as it's sent
+    if (rank != 0) {
+      stateBroadcast->post();
+    }
     if (app.cameraChanged) {
       camera.set("pos", app.v[0]);
       camera.set("dir", app.v[1]);
       camera.set("up", app.v[2]);
       camera.commit();
 
-      fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+      // Load finer AMR levels as the camera gets closer to the volume. Every
+      // rank has the same camera so they all pick the same level
+      const int amrLevels = amrLevelCount();
+      if (amrLevels > 1) {
+        const vec3f halfExtent = vec3f(pidxVolume->fullDims)
+          * pidxVolume->levelSpacing * 0.5f;
+        nextAMRLevel = selectAMRLevel(app.v[0], box3f(-halfExtent, halfExtent),
+            cameraFovy, app.fbSize.y, amrRefinement, amrLevels, dataset->amrLevel());
+        const int budgetLevel = std::min(nextAMRLevel, amrLevelInBudget());
+        if (budgetLevel < nextAMRLevel && nextAMRLevel != amrBudgetWarned && rank == 0) {
+          amrBudgetWarned = nextAMRLevel;
+          std::cout << "AMR level " << nextAMRLevel << " bricks would exceed the "
+            << amrBrickMB << "MB budget, loading level " << budgetLevel << "\n";
+        }
+        nextAMRLevel = budgetLevel;
+        amrLevelChanged = nextAMRLevel != dataset->amrLevel();
+      }
+
+      clearFrame();
       app.cameraChanged = false;
     }
-    auto startFrame = high_resolution_clock::now();
-
-    renderer.renderFrame(fb, OSP_FB_COLOR);
+    WorkerStatus status;
+    const float frameScale = frameController ? frameSettings.scale
+      : interacting ? interactionScale : 1.f;
+    const bool scaled = frameScale < 1.f;
+    if (scaled && scaledSize(frameScale) != scaledFbSize) {
+      scaledFbSize = scaledSize(frameScale);
+      scaledFb = FrameBuffer(scaledFbSize, OSP_FB_SRGBA,
+          OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+      scaledFb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+    }
+    FrameBuffer &frame = scaled ? scaledFb : fb;
+    const vec2i frameSize = scaled ? scaledFbSize : app.fbSize;
+    status.width = frameSize.x;
+    status.height = frameSize.y;
+    const bool rendered = !idle;
+    if (rendered) {
+      auto startFrame = high_resolution_clock::now();
+
+      // Each pass is accumulated into the frame, like rendering with more
+      // samples per pixel
+      const int passes = frameController ? frameSettings.spp : 1;
+      for (int i = 0; i < passes; ++i) {
+        status.variance = renderer.renderFrame(frame,
+            OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+      }
 
-    auto endFrame = high_resolution_clock::now();
+      auto endFrame = high_resolution_clock::now();
+      status.frameTime = duration_cast<milliseconds>(endFrame - startFrame).count();
+      // Coarse volumes will still be refined, so they're never done, and we
+      // don't stop on the scaled down frames rendered while the camera moves
+      status.converged = !interacting && varianceThreshold > 0.f
+        && status.variance < varianceThreshold
+        && pidxVolume->resolution == pidxVolume->maxResolution;
+    }
 
     if (rank == 0) {
-      const int frameTime = duration_cast<milliseconds>(endFrame - startFrame).count();
+      status.residentLevel = pidxVolume->resolution;
+      status.maxLevel = pidxVolume->maxResolution;
+      status.amrLevels = amrLevelCount();
+      status.amrLevel = std::min(dataset->amrLevel(), status.amrLevels - 1);
+      status.newHistogram = volumeChanged;
+      if (frameController) {
+        status.targetFps = targetFps;
+        status.spp = frameSettings.spp;
+        status.samplingRate = frameSettings.samplingRate;
+      }
 
-      uint32_t *img = (uint32_t*)fb.map(OSP_FB_COLOR);
-      client->send_frame(img, app.fbSize.x, app.fbSize.y, frameTime);
-      fb.unmap(img);
+      // Pick up the viewer's reply to the last frame, which was sent while we
+      // rendered this one. Its changes are applied at this frame boundary and
+      // show up in the next frame. Once we've converged the viewer holds its
+      // reply until something changes.
+      if (!viewerConnected) {
+        // We went idle when the last viewer disconnected. Wait for the next
+        // one and send it what it needs to pick up with the data we have,
+        // along with the last frame to reply to.
+        while (!viewerConnected) {
+          viewerConnected = frameSender->accept_client([&](ClientConnection &c) {
+            c.send_metadata(pidxVolume->pidxVars, uintahTimesteps,
+                appdata.currentVariable, app.currentTimestep, app.roi,
+                pidxVolume->valueRange, pidxVolume->histogram);
+          });
+        }
+        std::cout << "Viewer connected\n";
+        uint32_t *img = (uint32_t*)frame.map(OSP_FB_COLOR);
+        frameSender->send_frame(img, frameSize.x, frameSize.y, status,
+            pidxVolume->valueRange, pidxVolume->histogram);
+        frame.unmap(img);
+      }
+      viewerConnected = frameSender->wait_app_state(app, appdata);
+      if (!viewerConnected) {
+        std::cout << "Viewer disconnected, waiting for the next one\n";
+      } else if (!app.quit && !idle) {
+        volumeChanged = false;
+        uint32_t *img = (uint32_t*)frame.map(OSP_FB_COLOR);
+        frameSender->send_frame(img, frameSize.x, frameSize.y, status,
+            pidxVolume->valueRange, pidxVolume->histogram);
+        frame.unmap(img);
+      }
 
-      client->recieve_app_state(app, appdata);
+      // Only we get the frame's variance and know how long the camera has
+      // been still, so we decide for everyone. The frame rate controller
+      // adjusts the settings for the next frame based on how long this one took.
+      const auto now = steady_clock::now();
+      if (app.cameraChanged) {
+        lastCameraChange = now;
+      }
+      frameState.idle = status.converged || !viewerConnected;
+      frameState.interacting = scaleInteraction
+        && duration_cast<milliseconds>(now - lastCameraChange).count() < stillMs;
+      frameState.settingsChanged = frameController && rendered
+        && frameController->update(status.frameTime);
+      if (frameState.settingsChanged) {
+        frameState.settings = frameController->current();
+      }
+      stateBroadcast->send(app, appdata, frameState);
     }
 
-    // Send out the shared app state that the workers need to know, e.g. camera
-    // position, if we should be quitting.
-    MPI_Bcast(&app, sizeof(AppState), MPI_BYTE, 0, MPI_COMM_WORLD);
+    // Get the shared app state that the workers need to know, e.g. camera
+    // position, if we should be quitting. The viewer only replies to a
+    // converged frame once something changed, so we idle until then.
+    stateBroadcast->finish(app, appdata, frameState, idle);
+    idle = frameState.idle;
+    // The full resolution frame was cleared on the last camera change, so it
+    // starts accumulating from scratch when we switch back to it
+    interacting = frameState.interacting;
+    if (frameState.settingsChanged) {
+      const bool samplingRateChanged =
+        frameState.settings.samplingRate != frameSettings.samplingRate;
+      frameSettings = frameState.settings;
+      if (samplingRateChanged) {
+        applySamplingRate();
+        clearFrame();
+      }
+    }
 
     if (app.fbSizeChanged) {
-      fb = FrameBuffer(app.fbSize, OSP_FB_SRGBA, OSP_FB_COLOR | OSP_FB_ACCUM);
+      fb = FrameBuffer(app.fbSize, OSP_FB_SRGBA,
+          OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
       fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+      scaledFb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
       camera.set("aspect", static_cast<float>(app.fbSize.x) / app.fbSize.y);
       camera.commit();
 
       app.fbSizeChanged = false;
     }
     if (app.tfcnChanged) {
-      size_t sz = appdata.tfcn_colors.size();
-      MPI_Bcast(&sz, sizeof(size_t), MPI_BYTE, 0, MPI_COMM_WORLD);
-      if (rank != 0) {
-        appdata.tfcn_colors.resize(sz);
-      }
-      MPI_Bcast(appdata.tfcn_colors.data(), sizeof(vec3f) * appdata.tfcn_colors.size(),
-          MPI_BYTE, 0, MPI_COMM_WORLD);
-
-      sz = appdata.tfcn_alphas.size();
-      MPI_Bcast(&sz, sizeof(size_t), MPI_BYTE, 0, MPI_COMM_WORLD);
-      if (rank != 0) {
-        appdata.tfcn_alphas.resize(sz);
-      }
-      MPI_Bcast(appdata.tfcn_alphas.data(), sizeof(float) * appdata.tfcn_alphas.size(), MPI_BYTE,
-                0, MPI_COMM_WORLD);
-
       Data colorData(appdata.tfcn_colors.size(), OSP_FLOAT3, appdata.tfcn_colors.data());
       Data alphaData(appdata.tfcn_alphas.size(), OSP_FLOAT, appdata.tfcn_alphas.data());
       colorData.commit();
@@ -220,45 +686,105 @@ int main(int argc, char **argv) {
       tfcn.set("colors", colorData);
       tfcn.set("opacities", alphaData);
       tfcn.commit();
+      updateRegions();
 
-      fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
+      clearFrame();
       app.tfcnChanged = false;
     }
     if (app.fieldChanged) {
-      size_t sz = appdata.currentVariable.size();
-      MPI_Bcast(&sz, sizeof(size_t), MPI_BYTE, 0, MPI_COMM_WORLD);
-      if (rank != 0) {
-        appdata.currentVariable.resize(sz, ' ');
-      }
-      MPI_Bcast(&appdata.currentVariable[0], sz, MPI_BYTE, 0, MPI_COMM_WORLD);
       std::cout << "Got field change, to field #" << appdata.currentVariable << "\n";
     }
+    int scrubDirection = 1;
     if (app.timestepChanged) {
-      MPI_Bcast(&app.currentTimestep, sizeof(size_t), MPI_BYTE, 0, MPI_COMM_WORLD);
+      const size_t prevTimestep = pidxVolume->currentTimestep;
+      scrubDirection = app.currentTimestep < prevTimestep ? -1 : 1;
       std::cout << "Got timestep change, to time #" << app.currentTimestep << "\n";
-      if (!uintahTimesteps.empty()) {
-        auto t = std::find_if(uintahTimesteps.begin(), uintahTimesteps.end(),
-            [&](const UintahTimestep &t) {
-              return t.timestep == app.currentTimestep;
-            });
-        datasetPath = t->path;
+      auto t = uintahTimesteps.find(UintahTimestep(app.currentTimestep, ""));
+      if (t != uintahTimesteps.end()) {
+        datasetPath = t->levelPath(dataset->amrLevel());
         std::cout << "Changing to dataset path: " << datasetPath << "\n";
       }
     }
-    if (app.timestepChanged || app.fieldChanged) {
-      model.removeVolume(pidxVolume->volume);
-      pidxVolume = std::make_shared<PIDXVolume>(datasetPath, tfcn,
-          appdata.currentVariable, app.currentTimestep);
-      model.addVolume(pidxVolume->volume);
-      model.commit();
+    // Everything loaded or being loaded covers the old region, so start over
+    // from the new one
+    if (app.roiChanged) {
+      if (rank == 0) {
+        std::cout << "Got region of interest change, to " << app.roi << "\n";
+      }
+      loader = nullptr;
+      if (brickCache) {
+        brickCache->clear();
+      }
+      dataset->setRegionOfInterest(app.roi);
+    }
+    // Like the region of interest, changing the AMR level changes every brick.
+    // Datasets which aren't Uintah timesteps don't have levels to change to.
+    auto amrTimestep = uintahTimesteps.find(UintahTimestep(app.currentTimestep, ""));
+    if (amrLevelChanged && amrTimestep == uintahTimesteps.end()) {
+      amrLevelChanged = false;
+    }
+    if (amrLevelChanged) {
+      loader = nullptr;
+      if (brickCache) {
+        brickCache->clear();
+      }
+      dataset->setAMRLevel(nextAMRLevel);
+      datasetPath = amrTimestep->levelPath(nextAMRLevel);
+      if (rank == 0) {
+        std::cout << "Changing to AMR level " << nextAMRLevel << "\n";
+      }
+    }
+    if (app.timestepChanged || app.fieldChanged || app.roiChanged || amrLevelChanged) {
+      std::shared_ptr<PIDXVolume> nextVolume;
+      if (loader) {
+        nextVolume = loader->take(app.currentTimestep, appdata.currentVariable);
+      }
+      if (!nextVolume) {
+        nextVolume = std::make_shared<PIDXVolume>(*dataset, datasetPath, tfcn,
+            appdata.currentVariable, app.currentTimestep, brickCache.get(),
+            progressiveLevels, variables);
+      }
+      swapVolume(nextVolume);
+
+      if (app.roiChanged || amrLevelChanged) {
+        startLoader();
+      } else if (loader) {
+        loader->prefetch(app.currentTimestep, scrubDirection,
+            appdata.currentVariable);
+      }
+      startRefinement();
 
-      fb.clear(OSP_FB_COLOR | OSP_FB_ACCUM | OSP_FB_VARIANCE);
       app.fieldChanged = false;
       app.timestepChanged = false;
+      app.roiChanged = false;
+      amrLevelChanged = false;
+    }
+    // Swap in the next refinement of a coarse volume once it's been read
+    if (pidxVolume->resolution < pidxVolume->maxResolution) {
+      std::shared_ptr<PIDXVolume> refined;
+      bool refinementDone = false;
+      if (loader) {
+        refinementDone = loader->pollRefinement(refined);
+      } else {
+        // Without a loader thread we refine between frames instead
+        refined = std::make_shared<PIDXVolume>(*dataset, datasetPath, tfcn,
+            appdata.currentVariable, app.currentTimestep, brickCache.get(),
+            nextRefinement(), variables);
+        refinementDone = true;
+      }
+      if (refinementDone && refined) {
+        swapVolume(refined);
+        startRefinement();
+      }
     }
   }
 
+  frameSender = nullptr;
+  stateBroadcast = nullptr;
+  loader = nullptr;
   pidxVolume = nullptr;
+  brickCache = nullptr;
+  dataset = nullptr;
   ospShutdown();
   MPI_Finalize();
   return 0;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "PIDX.h"
+#include "util.h"
 
 #define PIDX_CHECK(F) \
   { \
@@ -45,3 +46,48 @@ inline std::string pidx_error_to_string(const PIDX_return_code rc) {
   else if (rc == PIDX_err_wavelet) return "PIDX_err_wavelet";
   else return "Unknown PIDX Error";
 }
+
+// Round x up to the next power of two
+inline size_t next_pow2(size_t x) {
+  size_t p = 1;
+  while (p < x) {
+    p <<= 1;
+  }
+  return p;
+}
+
+// Compute the number of HZ levels for a dataset of the given dimensions,
+// i.e. the HZ level holding the full resolution data.
+inline int hz_level_count(const vec3sz &dims) {
+  int levels = 0;
+  for (size_t i = 0; i < 3; ++i) {
+    for (size_t p = next_pow2(dims[i]); p > 1; p >>= 1) {
+      ++levels;
+    }
+  }
+  return levels;
+}
+
+/* Compute the spacing between the samples in each axis when the finest
+ * 'dropped' HZ levels aren't read. Each HZ level refines the axis with the
+ * most samples remaining, preferring z then y then x on ties, so coarsening
+ * undoes these splits starting from the finest level.
+ */
+inline vec3sz hz_level_stride(const vec3sz &dims, int dropped) {
+  vec3sz stride(1);
+  const vec3sz padded(next_pow2(dims.x), next_pow2(dims.y), next_pow2(dims.z));
+  for (; dropped > 0; --dropped) {
+    int axis = -1;
+    for (int i = 2; i >= 0; --i) {
+      const size_t samples = padded[i] / stride[i];
+      if (samples > 1 && (axis == -1 || samples > padded[axis] / stride[axis])) {
+        axis = i;
+      }
+    }
+    if (axis == -1) {
+      break;
+    }
+    stride[axis] *= 2;
+  }
+  return stride;
+}
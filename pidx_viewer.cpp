@@ -4,6 +4,9 @@
 #include <array>
 #include <chrono>
 #include <functional>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
 
 #include <turbojpeg.h>
 #include <GLFW/glfw3.h>
@@ -34,8 +37,54 @@ std::vector<unsigned char> jpgBuf;
 std::vector<ospcommon::vec3f> tfn_c;
 std::vector<ospcommon::vec2f> tfn_a;
 bool tfn_modified = false;
+// The histogram is drawn in the transfer function widget's window
+const char *TFN_WINDOW_NAME = "Transfer Function Widget";
+#else
+const char *TFN_WINDOW_NAME = "Transfer Function";
 #endif
 
+/* Draw the histogram of the data values in the transfer function window,
+ * log scaled so the bins with few voxels are still visible.
+ */
+void drawHistogram(const std::vector<float> &logHistogram, const vec2f &valueRange) {
+  if (logHistogram.empty()) {
+    return;
+  }
+  if (ImGui::Begin(TFN_WINDOW_NAME)) {
+    char rangeLabel[64] = {0};
+    std::snprintf(rangeLabel, 63, "[%g, %g]", valueRange.x, valueRange.y);
+    ImGui::Text("Data histogram (log scale)");
+    ImGui::PlotHistogram("##histogram", logHistogram.data(), logHistogram.size(),
+        0, rangeLabel, 0.f, FLT_MAX, ImVec2(ImGui::GetContentRegionAvailWidth(), 80));
+  }
+  ImGui::End();
+}
+
+/* Draw the controls for picking the region of the volume to load, normalized
+ * to [0, 1] along each axis. Returns true if the region should be sent to
+ * the workers to load.
+ */
+bool drawRegionOfInterest(box3f &roi) {
+  bool changed = false;
+  if (ImGui::Begin("Region of Interest")) {
+    const char *axes[] = {"x", "y", "z"};
+    for (size_t i = 0; i < 3; ++i) {
+      ImGui::DragFloatRange2(axes[i], &roi.lower[i], &roi.upper[i], 0.005f,
+          0.f, 1.f, "Min: %.3f", "Max: %.3f");
+    }
+    if (ImGui::Button("Load Region")) {
+      changed = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Full Volume")) {
+      roi = box3f(vec3f(0.f), vec3f(1.f));
+      changed = true;
+    }
+  }
+  ImGui::End();
+  return changed;
+}
+
 // Extra stuff we need in GLFW callbacks
 struct WindowState {
   Arcball &camera;
@@ -192,28 +241,43 @@ int main(int argc, const char **argv)
   glfwSetCharCallback(window, charCallback);
 
   JPGDecompressor decompressor;
+  // The workers take our camera with the first reply, so it must be set
+  // before we connect
+  app.v[0] = arcballCamera.eyePos();
+  app.v[1] = arcballCamera.lookDir();
+  app.v[2] = arcballCamera.upDir();
   ServerConnection server(serverhost, port, app);
 
   std::vector<std::string> variables;
   std::vector<size_t> timesteps;
 
-  std::vector<uint32_t> imgBuf;
-  int frameTime = 0;
+  // The last frame received, which is smaller than the window while the
+  // camera is moving
+  std::vector<uint32_t> imgBuf(app.fbSize.x * app.fbSize.y, 0);
+  vec2i imgSize = app.fbSize;
+  WorkerStatus workerStatus;
+  vec2f valueRange(0.f);
+  std::vector<uint64_t> histogram;
+  std::vector<float> logHistogram;
 
   while (!app.quit)
   {
     //--------------------------------
-    imgBuf.resize(app.fbSize.x * app.fbSize.y, 0);
-    if (server.get_new_frame(jpgBuf, frameTime)) {
-      decompressor.decompress(jpgBuf.data(), jpgBuf.size(), app.fbSize.x,
-          app.fbSize.y, imgBuf);
+    if (server.get_new_frame(jpgBuf, workerStatus)) {
+      imgSize = vec2i(workerStatus.width, workerStatus.height);
+      decompressor.decompress(jpgBuf.data(), jpgBuf.size(), imgSize.x,
+          imgSize.y, imgBuf);
     }
 #ifndef USE_TFN_MODULE
     const auto tfcnTimeStamp = transferFcn->childrenLastModified();
 #endif
     //--------------------------------    
     glClear(GL_COLOR_BUFFER_BIT);
-    glDrawPixels(app.fbSize.x, app.fbSize.y, GL_RGBA, GL_UNSIGNED_BYTE, imgBuf.data());
+    // Scale the frame up to fill the window
+    glPixelZoom(static_cast<float>(app.fbSize.x) / imgSize.x,
+        static_cast<float>(app.fbSize.y) / imgSize.y);
+    glDrawPixels(imgSize.x, imgSize.y, GL_RGBA, GL_UNSIGNED_BYTE, imgBuf.data());
+    glPixelZoom(1.f, 1.f);
     
     ImGui_ImplGlfwGL3_NewFrame();
 
@@ -222,6 +286,14 @@ int main(int argc, const char **argv)
 #else
     tfnWidget->drawUI();
 #endif
+    if (server.get_histogram(valueRange, histogram)) {
+      logHistogram.clear();
+      std::transform(histogram.begin(), histogram.end(),
+          std::back_inserter(logHistogram),
+          [](const uint64_t c) { return std::log1p(static_cast<float>(c)); });
+    }
+    drawHistogram(logHistogram, valueRange);
+    app.roiChanged = drawRegionOfInterest(app.roi);
     
     //--------------------------------
     const float DISTANCE = 10.0f;
@@ -268,7 +340,7 @@ int main(int argc, const char **argv)
       if (variables.empty() && timesteps.empty()) {
         ImGui::Text("Waiting for server to load data");
         server.get_metadata(variables, timesteps, appdata.currentVariable,
-            app.currentTimestep);
+            app.currentTimestep, app.roi);
 
         if (!timesteps.empty()) {
           auto t = std::find(timesteps.begin(), timesteps.end(), app.currentTimestep);
@@ -280,7 +352,36 @@ int main(int argc, const char **argv)
           windowState->currentVariableIdx = std::distance(variables.begin(), v);
         }
       } else {
-        ImGui::Text("Last frame took %dms", frameTime);
+        if (workerStatus.converged) {
+          ImGui::Text("Converged (variance %.4f), idle", workerStatus.variance);
+        } else if (imgSize != app.fbSize) {
+          ImGui::Text("Last frame took %dms at %dx%d", workerStatus.frameTime,
+              imgSize.x, imgSize.y);
+        } else {
+          ImGui::Text("Last frame took %dms", workerStatus.frameTime);
+        }
+        if (workerStatus.targetFps > 0.f) {
+          ImGui::Text("Target %.1f FPS: %d%% resolution, %d passes, sampling rate %.3f",
+              workerStatus.targetFps, 100 * imgSize.x / std::max(app.fbSize.x, 1),
+              workerStatus.spp, workerStatus.samplingRate);
+        }
+        if (workerStatus.residentLevel < workerStatus.maxLevel) {
+          ImGui::Text("Refining: HZ level %d of %d", workerStatus.residentLevel,
+              workerStatus.maxLevel);
+        } else {
+          ImGui::Text("Full resolution (HZ level %d)", workerStatus.maxLevel);
+        }
+        if (workerStatus.amrLevels > 1) {
+          ImGui::Text("AMR level %d of %d", workerStatus.amrLevel,
+              workerStatus.amrLevels - 1);
+        }
+      }
+      // Closing the viewer leaves the workers running with the data loaded
+      // for the next viewer to connect, this stops them
+      ImGui::Separator();
+      if (ImGui::Button("Shut Down Workers")) {
+        server.shutdown_workers();
+        app.quit = true;
       }
     }
     ImGui::PopStyleColor();    
@@ -1,7 +1,18 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
 #include <mpiCommon/MPICommon.h>
 #include <mpi.h>
+#include "ospcommon/tasking/parallel_for.h"
 #include "common/imgui/imgui.h"
 #include "pidx_volume.h"
+#include "ghost_exchange.h"
+#include "volume_stats.h"
 
 using namespace ospray::cpp;
 using namespace ospcommon;
@@ -33,186 +44,746 @@ IDXVar parse_idx_type(const std::string &type) {
   return var;
 }
 
-template<typename T>
-std::pair<T, T> compute_range(const std::vector<char> &data) {
-  auto minmax =
-    std::minmax_element(reinterpret_cast<const T*>(data.data()),
-			reinterpret_cast<const T*>(data.data()) + data.size() / sizeof(T));
-  return std::make_pair(*minmax.first, *minmax.second);
+OSPDataType osp_data_type(const std::string &voxelType) {
+  if (voxelType == "uchar") {
+    return OSP_UCHAR;
+  } else if (voxelType == "short") {
+    return OSP_SHORT;
+  } else if (voxelType == "ushort") {
+    return OSP_USHORT;
+  } else if (voxelType == "float") {
+    return OSP_FLOAT;
+  } else if (voxelType == "double") {
+    return OSP_DOUBLE;
+  }
+  throw std::runtime_error("Unsupported voxel type " + voxelType);
+}
+
+/* Gather the samples on the stride lattice, starting at the first voxel, out
+ * of the box of row-major data read from PIDX into a dense row-major brick.
+ * The gather is done in place and the dimensions of the dense brick returned.
+ */
+vec3sz compact_strided(std::vector<char> &data, const vec3sz &dims,
+    const vec3sz &stride, const size_t voxelSize)
+{
+  if (stride == vec3sz(1)) {
+    return dims;
+  }
+  const vec3sz outDims = (dims - vec3sz(1)) / stride + vec3sz(1);
+  char *out = data.data();
+  for (size_t z = 0; z < outDims.z; ++z) {
+    for (size_t y = 0; y < outDims.y; ++y) {
+      for (size_t x = 0; x < outDims.x; ++x) {
+        const size_t i = ((z * stride.z) * dims.y + y * stride.y) * dims.x + x * stride.x;
+        std::memmove(out, data.data() + i * voxelSize, voxelSize);
+        out += voxelSize;
+      }
+    }
+  }
+  data.resize(outDims.x * outDims.y * outDims.z * voxelSize);
+  data.shrink_to_fit();
+  return outDims;
+}
+
+// Voxels are converted in blocks of this many voxels, one task per block
+const size_t CONVERT_BLOCK_SIZE = 1 << 20;
+
+template<typename In>
+std::vector<char> convert_from(const std::vector<char> &data,
+    const std::string &outType, const vec2f &range)
+{
+  const In *in = reinterpret_cast<const In*>(data.data());
+  const size_t count = data.size() / sizeof(In);
+  const size_t nblocks = (count + CONVERT_BLOCK_SIZE - 1) / CONVERT_BLOCK_SIZE;
+  std::vector<char> out;
+  if (outType == "float") {
+    out.resize(count * sizeof(float));
+    float *f = reinterpret_cast<float*>(out.data());
+    tasking::parallel_for(nblocks, [&](const size_t b) {
+      const size_t end = std::min(count, (b + 1) * CONVERT_BLOCK_SIZE);
+      for (size_t i = b * CONVERT_BLOCK_SIZE; i < end; ++i) {
+        f[i] = static_cast<float>(in[i]);
+      }
+    });
+  } else if (outType == "ushort") {
+    out.resize(count * sizeof(uint16_t));
+    uint16_t *q = reinterpret_cast<uint16_t*>(out.data());
+    const double scale = range.y > range.x ? 65535.0 / (range.y - range.x) : 0.0;
+    tasking::parallel_for(nblocks, [&](const size_t b) {
+      const size_t end = std::min(count, (b + 1) * CONVERT_BLOCK_SIZE);
+      for (size_t i = b * CONVERT_BLOCK_SIZE; i < end; ++i) {
+        const double x = (in[i] - range.x) * scale + 0.5;
+        q[i] = static_cast<uint16_t>(std::max(0.0, std::min(x, 65535.0)));
+      }
+    });
+  } else {
+    throw std::runtime_error("Unsupported storage type " + outType);
+  }
+  return out;
+}
+
+/* Convert the voxels in data from inType to outType in parallel. Converting
+ * to ushort quantizes the values over the range.
+ */
+void convert_voxels(std::vector<char> &data, const std::string &inType,
+    const std::string &outType, const vec2f &range)
+{
+  std::vector<char> out;
+  if (inType == "float") {
+    out = convert_from<float>(data, outType, range);
+  } else if (inType == "double") {
+    out = convert_from<double>(data, outType, range);
+  } else {
+    throw std::runtime_error("Can't convert voxels of type " + inType);
+  }
+  data.swap(out);
+}
+
+/* One AMR level being read to fill in a brick of a finer level, the brick's
+ * voxels are in the finest level's index space, where each of this level's
+ * voxels covers scale voxels along each axis.
+ */
+struct AMRLevelRead {
+  PIDX_file file;
+  vec3sz dims;
+  size_t scale;
+  // The box of the level's voxels covering the brick, clipped to the level
+  vec3sz offset, size;
+  // The voxels read for each variable
+  std::vector<std::vector<char>> data;
+
+  bool empty() const {
+    return size.x == 0 || size.y == 0 || size.z == 0;
+  }
+};
+
+/* Copy the level's voxels into the brick with offset and dims wherever the
+ * level covers it, replicating each of the level's voxels over the scale^3
+ * brick voxels it covers.
+ */
+void paste_amr_level(const AMRLevelRead &level, const std::vector<char> &levelData,
+    std::vector<char> &brick, const vec3sz &offset, const vec3sz &dims,
+    const size_t voxelSize)
+{
+  vec3sz lower, upper;
+  for (size_t i = 0; i < 3; ++i) {
+    lower[i] = std::max(offset[i], level.offset[i] * level.scale);
+    upper[i] = std::min(offset[i] + dims[i], (level.offset[i] + level.size[i]) * level.scale);
+    if (lower[i] >= upper[i]) {
+      return;
+    }
+  }
+  tasking::parallel_for(upper.z - lower.z, [&](const size_t dz) {
+    const size_t z = lower.z + dz;
+    const size_t lz = z / level.scale - level.offset.z;
+    for (size_t y = lower.y; y < upper.y; ++y) {
+      const size_t ly = y / level.scale - level.offset.y;
+      char *out = brick.data() + (((z - offset.z) * dims.y + y - offset.y) * dims.x
+          + lower.x - offset.x) * voxelSize;
+      for (size_t x = lower.x; x < upper.x; ++x, out += voxelSize) {
+        const size_t lx = x / level.scale - level.offset.x;
+        std::memcpy(out, levelData.data()
+            + ((lz * level.size.y + ly) * level.size.x + lx) * voxelSize, voxelSize);
+      }
+    }
+  });
+}
+
+/* The modification time and size of the file, to tell a rewritten file apart
+ * from the one we read before. Both are zero if the file can't be stat'd.
+ */
+std::string file_version(const std::string &path) {
+  struct stat fileStat = {0};
+  if (stat(path.c_str(), &fileStat) != 0) {
+    return "0,0";
+  }
+  return std::to_string(fileStat.st_mtime) + "," + std::to_string(fileStat.st_size);
 }
 
-vec2f compute_volume_range(const std::vector<char> &data, const std::string &type) {
-  vec2f range(0, 0);
-  if (type == "uchar") {
-    auto minmax = compute_range<uint8_t>(data);
-    range.x = static_cast<float>(minmax.first);
-    range.y = static_cast<float>(minmax.second);
-  } else if (type == "short") {
-    auto minmax = compute_range<int16_t>(data);
-    range.x = static_cast<float>(minmax.first);
-    range.y = static_cast<float>(minmax.second);
-  } else if (type == "ushort") {
-    auto minmax = compute_range<uint16_t>(data);
-    range.x = static_cast<float>(minmax.first);
-    range.y = static_cast<float>(minmax.second);
-  } else if (type == "float") {
-    auto minmax = compute_range<float>(data);
-    range.x = minmax.first;
-    range.y = minmax.second;
-  } else if (type == "double") {
-    auto minmax = compute_range<double>(data);
-    range.x = static_cast<float>(minmax.first);
-    range.y = static_cast<float>(minmax.second);
-    std::cout << "range = " << range << "\n";
-  }
-  return range;
+// The most I/O settings autotuning tries, including the initial ones
+const size_t MAX_AUTOTUNE_TRIALS = 8;
+// The trial reads skip the finest HZ levels, reading an eighth of the voxels
+const int AUTOTUNE_COARSEN_LEVELS = 3;
+
+PIDXIOSettings autotune_io_settings(PIDXDataset &dataset, const std::string &path,
+    TransferFunction tfcn, const std::string &variable, const size_t timestep)
+{
+  MPI_Comm comm = dataset.communicator();
+  int rank = 0;
+  int numRanks = 0;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numRanks);
+
+  // Try the current settings and the aggregator multipliers and partition
+  // counts which evenly split the ranks, up to the trial limit
+  const PIDXIOSettings initial = dataset.ioSettings();
+  std::vector<PIDXIOSettings> candidates{initial};
+  const std::vector<vec3i> partitionCounts = {
+    vec3i(1), vec3i(2, 1, 1), vec3i(2, 2, 1), vec3i(2, 2, 2), vec3i(4, 4, 4)
+  };
+  for (const auto &p : partitionCounts) {
+    for (const int multiplier : {1, 2, 4}) {
+      const int partitions = p.x * p.y * p.z;
+      if (partitions > numRanks || numRanks % partitions != 0
+          || candidates.size() >= MAX_AUTOTUNE_TRIALS)
+      {
+        continue;
+      }
+      PIDXIOSettings s = initial;
+      s.aggregatorMultiplier = multiplier;
+      s.partitionCount = p;
+      candidates.push_back(s);
+    }
+  }
+
+  PIDXIOSettings best = initial;
+  double bestBandwidth = -1.0;
+  for (const auto &c : candidates) {
+    dataset.setIOSettings(c);
+    double bytes = 0.0;
+    double readTime = 0.0;
+    {
+      // A coarse HZ level is enough to compare the settings, without paying
+      // for a full resolution read of each. AMR levels are always read whole.
+      PIDXVolume trial(dataset, path, tfcn, variable, timestep, nullptr,
+          AUTOTUNE_COARSEN_LEVELS);
+      const double localBytes = trial.timings.bytesRead;
+      const double localRead = trial.timings.seconds[PHASE_READ];
+      MPI_Allreduce(&localBytes, &bytes, 1, MPI_DOUBLE, MPI_SUM, comm);
+      MPI_Allreduce(&localRead, &readTime, 1, MPI_DOUBLE, MPI_MAX, comm);
+    }
+    const double bandwidth = readTime > 0.0 ? bytes * 1e-6 / readTime : 0.0;
+    if (rank == 0) {
+      std::cout << "I/O autotune: " << c << " read at " << bandwidth << " MB/s\n";
+    }
+    if (bandwidth > bestBandwidth) {
+      best = c;
+      bestBandwidth = bandwidth;
+    }
+  }
+  dataset.setIOSettings(best);
+  if (rank == 0) {
+    std::cout << "I/O autotune picked " << best << std::endl;
+  }
+  return best;
 }
 
-PIDXVolume::PIDXVolume(const std::string &path, TransferFunction tfcn,
-    const std::string &currentVariableName, size_t currentTimestep)
-  : datasetPath(path), volume("block_bricked_volume"), transferFunction(tfcn),
-  currentVariableName(currentVariableName), currentTimestep(currentTimestep)
+PIDXVolume::PIDXVolume(PIDXDataset &dataset, const std::string &path,
+    TransferFunction tfcn, const std::string &currentVariableName,
+    size_t currentTimestep, BrickCache *cache, int coarsenLevels,
+    const std::vector<std::string> &siblingVariables)
+  : datasetPath(path), comm(dataset.communicator()), transferFunction(tfcn),
+  cache(cache), readFromPIDX(false), currentVariableName(currentVariableName),
+  currentTimestep(currentTimestep)
 {
-  PIDX_CHECK(PIDX_create_access(&pidxAccess));
-  PIDX_CHECK(PIDX_set_mpi_access(pidxAccess, MPI_COMM_WORLD));
   currentVariable = -1;
-  update();
+  update(dataset, coarsenLevels, siblingVariables);
 }
 PIDXVolume::~PIDXVolume() {
-  PIDX_close_access(pidxAccess);
-  volume.release();
+  if (volume.handle()) {
+    volume.release();
+  }
 }
-void PIDXVolume::update() {
-  const int rank = mpicommon::world.rank;
-  const int numRanks = mpicommon::world.size;
+void PIDXVolume::upload(const bool shareBrick) {
+  auto phaseStart = LoadClock::now();
+  transferFunction.set("valueRange", voxelRange);
+  transferFunction.commit();
 
-  PIDX_CHECK(PIDX_file_open(datasetPath.c_str(), PIDX_MODE_RDONLY,
-        pidxAccess, pdims, &pidxFile));
-  fullDims = vec3sz(pdims[0], pdims[1], pdims[2]);
+  // Bricks mapped from the disk cache are always shared, copying them would
+  // throw away the point of mapping them
+  const bool share = shareBrick || brick->mapping;
+  volume = ospray::cpp::Volume(share ? "shared_structured_volume"
+      : "block_bricked_volume");
+  volume.set("transferFunction", transferFunction);
+  voxelType = brick->voxelType;
+  volume.set("voxelType", voxelType);
+  volume.set("dimensions", vec3i(localDims));
+  volume.set("gridOrigin", (vec3f(localOffset) - vec3f(fullDims) / 2.f) * levelSpacing);
+  volume.set("gridSpacing", vec3f(stride) * levelSpacing);
 
-  if (rank == 0) {
-     std::cout << "currentimestep = " << currentTimestep << std::endl;
+  if (share) {
+    // Render directly from the brick, which we keep alive as long as the volume
+    ospray::cpp::Data voxelData(localDims.x * localDims.y * localDims.z,
+        osp_data_type(brick->voxelType), brick->voxels(),
+        OSP_DATA_SHARED_BUFFER);
+    voxelData.commit();
+    volume.set("voxelData", voxelData);
+    timings.lap(PHASE_UPLOAD, phaseStart);
+    volume.commit();
+    timings.lap(PHASE_COMMIT, phaseStart);
+    voxelData.release();
+  } else {
+    // Now we have some row-major data in the array we can pass to an OSPRay volume
+    // OSPRay only reads from the region, but takes it as non-const
+    volume.setRegion(const_cast<char*>(brick->voxels()), vec3i(0), vec3i(localDims));
+    timings.lap(PHASE_UPLOAD, phaseStart);
+    volume.commit();
+    timings.lap(PHASE_COMMIT, phaseStart);
+
+    // The volume has its own copy of the data now, though the cache may keep
+    // the brick around for later
+    brick = nullptr;
+  }
+  // Cache hits have no I/O worth reporting and would throw off the bandwidth
+  if (readFromPIDX) {
+    timings.report(MPI_COMM_WORLD);
   }
-  PIDX_CHECK(PIDX_set_current_time_step(pidxFile, currentTimestep));
+}
+void PIDXVolume::update(PIDXDataset &dataset, int coarsenLevels,
+    const std::vector<std::string> &siblingVariables)
+{
+  int rank = 0;
+  int numRanks = 0;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numRanks);
+  auto phaseStart = LoadClock::now();
 
-  if (pidxVars.empty()) {
-    int variableCount = 0;
-    PIDX_CHECK(PIDX_get_variable_count(pidxFile, &variableCount));
+  if (cache) {
+    brick = cache->find(currentTimestep, currentVariableName, coarsenLevels);
+    // A miss on any rank means we all have to do the collective read
+    int hit = brick ? 1 : 0;
+    int allHit = 0;
+    MPI_Allreduce(&hit, &allHit, 1, MPI_INT, MPI_MIN, comm);
+    cache->countLookup(allHit);
     if (rank == 0) {
-      std::cout << "Variable count = " << variableCount << "\n";
+      std::cout << "Brick cache " << (allHit ? "hit" : "miss")
+        << " for timestep " << currentTimestep << ", variable "
+        << currentVariableName << ": " << cache->hitCount() << " hits, "
+        << cache->missCount() << " misses, "
+        << cache->bytesUsed() * 1e-6 << "MB cached\n";
     }
-
-    for (int i = 0; i < variableCount; ++i) {
-      PIDX_CHECK(PIDX_set_current_variable_index(pidxFile, i));
-      PIDX_variable variable;
-      PIDX_CHECK(PIDX_get_current_variable(pidxFile, &variable));
-      pidxVars.push_back(variable->var_name);
-      if (currentVariableName.compare(variable->var_name) == 0) {
-        currentVariable = i;
+    if (allHit && cache->compressed()) {
+      // Report each rank's compression ratio and time to decompress the brick
+      const double localStats[2] = {cache->compressionRatio(),
+        cache->lastDecompressTime()};
+      std::vector<double> rankStats(rank == 0 ? 2 * numRanks : 0);
+      MPI_Gather(localStats, 2, MPI_DOUBLE, rankStats.data(), 2, MPI_DOUBLE, 0, comm);
+      if (rank == 0) {
+        for (int i = 0; i < numRanks; ++i) {
+          std::cout << "Rank " << i << " compressed cache ratio: "
+            << rankStats[2 * i] << ", decompressed brick in "
+            << rankStats[2 * i + 1] * 1000.0 << "ms\n";
+        }
       }
     }
+    if (allHit) {
+      pidxVars = dataset.variableNames();
+      currentVariable = dataset.variableIndex(currentVariableName);
+      useBrick();
+      timings.lap(PHASE_CACHE, phaseStart);
+      return;
+    }
+  }
 
-    if (currentVariable == -1) {
-      currentVariable = 0;
-      std::cerr << "Variable name is not set. "
-        "Loading the first variable by default" << std::endl;
+  // See if we stored the brick on local disk in an earlier run before going
+  // to the filesystem
+  if (dataset.diskCache()) {
+    std::vector<std::string> diskVars;
+    brick = dataset.diskCache()->load(diskBrickKey(dataset, currentVariableName,
+          coarsenLevels), diskVars);
+    int hit = brick ? 1 : 0;
+    int allHit = 0;
+    MPI_Allreduce(&hit, &allHit, 1, MPI_INT, MPI_MIN, comm);
+    if (rank == 0) {
+      std::cout << "Disk cache " << (allHit ? "hit" : "miss")
+        << " for timestep " << currentTimestep << ", variable "
+        << currentVariableName << "\n";
+    }
+    if (allHit) {
+      pidxVars = dataset.variableNames().empty() ? diskVars : dataset.variableNames();
+      const auto v = std::find(pidxVars.begin(), pidxVars.end(), currentVariableName);
+      currentVariable = v == pidxVars.end() ? -1 : std::distance(pidxVars.begin(), v);
+      useBrick();
+      if (cache) {
+        cache->insert(currentTimestep, currentVariableName, coarsenLevels, brick);
+      }
+      timings.lap(PHASE_CACHE, phaseStart);
+      return;
     }
   }
+  brick = std::make_shared<VolumeBrick>();
+  readFromPIDX = true;
+  timings.lap(PHASE_CACHE, phaseStart);
 
-  MPI_Bcast(&currentVariable, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (rank == 0) {
+     std::cout << "currentimestep = " << currentTimestep << std::endl;
+  }
+  PIDX_file pidxFile = dataset.open(datasetPath, currentTimestep, fullDims);
+  // If we're loading a refined AMR level also open the coarser levels, the
+  // volume covers all of them at the finest level's resolution
+  const int amrLevel = uintahLevel(datasetPath);
+  std::vector<AMRLevelRead> amrLevels(amrLevel > 0 ? amrLevel + 1 : 0);
+  levelSpacing = 1.f;
+  for (int l = 0; l < static_cast<int>(amrLevels.size()); ++l) {
+    AMRLevelRead &level = amrLevels[l];
+    level.scale = 1;
+    for (int i = l; i < amrLevel; ++i) {
+      level.scale *= dataset.amrRefinement();
+    }
+    if (l == amrLevel) {
+      level.file = pidxFile;
+      level.dims = fullDims;
+    } else {
+      level.file = dataset.open(uintahLevelPath(datasetPath, l), currentTimestep,
+          level.dims);
+    }
+    fullDims = ospcommon::max(fullDims, level.dims * level.scale);
+  }
+  if (!amrLevels.empty()) {
+    levelSpacing = 1.f / amrLevels[0].scale;
+    if (rank == 0) {
+      std::cout << "Reading AMR levels 0 to " << amrLevel << " into a volume of "
+        << fullDims << " level " << amrLevel << " voxels\n";
+    }
+  }
+  timings.lap(PHASE_OPEN, phaseStart);
+  pidxVars = dataset.variableNames();
+  maxResolution = hz_level_count(fullDims);
+  resolution = amrLevels.empty() ? std::max(maxResolution - coarsenLevels, 0) : maxResolution;
+  stride = hz_level_stride(fullDims, maxResolution - resolution);
 
-  PIDX_CHECK(PIDX_set_current_variable_index(pidxFile, currentVariable));
-  PIDX_variable variable;
-  PIDX_CHECK(PIDX_get_current_variable(pidxFile, &variable));
+  currentVariable = dataset.variableIndex(currentVariableName);
+  if (currentVariable == -1) {
+    currentVariable = 0;
+    std::cerr << "Variable name is not set. "
+      "Loading the first variable by default" << std::endl;
+  }
 
-  int valuesPerSample = 0;
-  int bitsPerSample = 0;
-  PIDX_CHECK(PIDX_values_per_datatype(variable->type_name, &valuesPerSample,
-        &bitsPerSample));
-  const int bytesPerSample = bitsPerSample / 8;
+  MPI_Bcast(&currentVariable, 1, MPI_INT, 0, comm);
 
-  if (rank == 0) {
-    std::cout << "Volume dimensions: " << fullDims << "\n"
-      << "Variable type name: " << variable->type_name << "\n"
-      << "Values per sample: " << valuesPerSample << "\n"
-      << "Bits per sample: " << bitsPerSample << std::endl;
+  // The other variables to read in the same file session and cache, the
+  // variable we're loading is always the first brick read
+  std::vector<int> readVariables{currentVariable};
+  if (cache) {
+    for (const auto &v : siblingVariables) {
+      const int index = dataset.variableIndex(v);
+      if (index == -1) {
+        if (rank == 0) {
+          std::cerr << "Skipping unknown variable " << v << "\n";
+        }
+      } else if (std::find(readVariables.begin(), readVariables.end(), index)
+          == readVariables.end())
+      {
+        readVariables.push_back(index);
+      }
+    }
   }
-  const IDXVar idx_var = parse_idx_type(variable->type_name);
 
-  const vec3sz grid = vec3sz(computeGrid(numRanks));
-  const vec3sz brickDims = vec3sz(fullDims) / grid;
+  // Split the region of interest over the ranks, which is the whole volume
+  // unless the viewer picked a smaller region
+  vec3sz roiOffset, roiDims;
+  dataset.regionOfInterest(fullDims, roiOffset, roiDims);
+  if (rank == 0 && roiDims != fullDims) {
+    std::cout << "Reading region of interest at " << roiOffset
+      << " of size " << roiDims << "\n";
+  }
+  // computeGrid won't split an axis into more bricks than it has voxels, but
+  // the ghost exchange below relies on every brick being at least a voxel
+  // thick, so make sure of it
+  const vec3sz grid = vec3sz(computeGrid(numRanks, roiDims));
+  for (size_t i = 0; i < 3; ++i) {
+    if (roiDims[i] < grid[i]) {
+      throw std::runtime_error("The region of interest is too small to split "
+          "over " + std::to_string(numRanks) + " ranks");
+    }
+  }
   const vec3sz brickId(rank % grid.x, (rank / grid.x) % grid.y, rank / (grid.x * grid.y));
+  vec3sz brickOffset, brickDims;
+  computeBrickBounds(vec3i(brickId), vec3i(grid), roiDims, brickOffset, brickDims);
+  brickOffset = roiOffset + brickOffset;
 
+  // At full resolution we only read the voxels we own and get the ghost
+  // voxels from our neighbors. Coarse levels read a layer of ghost voxels
+  // along with the brick, since their lattice doesn't line up with the bricks
+  const bool exchangeGhosts = resolution == maxResolution;
+  int ghostWidth = 1;
+  if (exchangeGhosts) {
+    // Our neighbors can't send more layers than their bricks have, but we
+    // always need at least the one layer to interpolate across the boundary
+    ghostWidth = dataset.ghostWidth();
+    for (size_t i = 0; i < 3; ++i) {
+      if (grid[i] > 1) {
+        ghostWidth = std::min(ghostWidth, static_cast<int>(roiDims[i] / grid[i]));
+      }
+    }
+    ghostWidth = std::max(ghostWidth, 1);
+    if (rank == 0 && ghostWidth < dataset.ghostWidth()) {
+      std::cout << "Bricks are too thin for " << dataset.ghostWidth()
+        << " ghost layers, using " << ghostWidth << "\n";
+    }
+  }
   const std::array<int, 3> ghosts = computeGhostFaces(vec3i(brickId), vec3i(grid));
-  vec3sz ghostDims(0);
+  vec3sz ghostLower(0), ghostUpper(0);
   for (size_t i = 0; i < 3; ++i) {
+    if (ghosts[i] & NEG_FACE) {
+      ghostLower[i] = ghostWidth;
+    }
     if (ghosts[i] & POS_FACE) {
-      ghostDims[i] += 1;
+      ghostUpper[i] = ghostWidth;
     }
-    if (ghosts[i] & NEG_FACE) {
-      ghostDims[i] += 1;
+  }
+  localDims = brickDims + ghostLower + ghostUpper;
+  localOffset = brickOffset - ghostLower;
+
+  if (resolution < maxResolution) {
+    PIDX_CHECK(PIDX_set_resolution(pidxFile, 0, resolution));
+    // Grow the box out to the samples on the coarse level's lattice enclosing
+    // it, so the coarse bricks still meet at the brick boundaries
+    const vec3sz lower = (localOffset / stride) * stride;
+    const vec3sz upper = ospcommon::min(((localOffset + localDims - vec3sz(1) + stride - vec3sz(1))
+          / stride) * stride, fullDims - vec3sz(1));
+    localOffset = lower;
+    localDims = upper - lower + vec3sz(1);
+  }
+
+  // The box of voxels we read from PIDX
+  const vec3sz readOffset = exchangeGhosts ? brickOffset : localOffset;
+  const vec3sz readSize = exchangeGhosts ? brickDims : localDims;
+  PIDX_point pReadOffset, pReadSize;
+  PIDX_set_point(pReadOffset, readOffset.x, readOffset.y, readOffset.z);
+  PIDX_set_point(pReadSize, readSize.x, readSize.y, readSize.z);
+
+  // Find the part of each AMR level covering our brick, the finer levels
+  // are only read where they exist
+  for (auto &level : amrLevels) {
+    for (size_t i = 0; i < 3; ++i) {
+      level.offset[i] = std::min(readOffset[i] / level.scale, level.dims[i]);
+      const size_t end = std::min((readOffset[i] + readSize[i] + level.scale - 1)
+          / level.scale, level.dims[i]);
+      level.size[i] = end - level.offset[i];
     }
   }
-  localDims = brickDims + ghostDims;
-  const vec3sz ghostOffset(ghosts[0] & NEG_FACE ? 1 : 0,
-      ghosts[1] & NEG_FACE ? 1 : 0,
-      ghosts[2] & NEG_FACE ? 1 : 0);
 
-  localOffset = brickId * brickDims - ghostOffset;
-  PIDX_point pLocalOffset, pLocalDims;
-  PIDX_set_point(pLocalOffset, localOffset.x, localOffset.y, localOffset.z);
-  PIDX_set_point(pLocalDims, localDims.x, localDims.y, localDims.z);
+  const size_t nReadVals = readSize.x * readSize.y * readSize.z;
+  std::vector<std::shared_ptr<VolumeBrick>> bricks;
+  std::vector<size_t> voxelSizes;
+  timings.lap(PHASE_METADATA, phaseStart);
+  for (const int v : readVariables) {
+    PIDX_CHECK(PIDX_set_current_variable_index(pidxFile, v));
+    PIDX_variable variable;
+    PIDX_CHECK(PIDX_get_current_variable(pidxFile, &variable));
 
-  const size_t nLocalVals = localDims.x * localDims.y * localDims.z;
-  std::vector<char> data(bytesPerSample * valuesPerSample * nLocalVals, 0);
-  PIDX_CHECK(PIDX_variable_read_data_layout(variable, pLocalOffset, pLocalDims,
-        data.data(), PIDX_row_major));
+    int valuesPerSample = 0;
+    int bitsPerSample = 0;
+    PIDX_CHECK(PIDX_values_per_datatype(variable->type_name, &valuesPerSample,
+          &bitsPerSample));
+    const int bytesPerSample = bitsPerSample / 8;
 
-  using namespace std::chrono;
-  auto startLoad = high_resolution_clock::now();
-  PIDX_CHECK(PIDX_close(pidxFile));
-  auto endLoad = high_resolution_clock::now();
-  const double loadTime = duration_cast<milliseconds>(endLoad - startLoad).count() * 0.001;
-  const double bandwidthMB = (data.size() * 1e-6) / loadTime;
+    if (rank == 0) {
+      std::cout << "Volume dimensions: " << fullDims << "\n"
+        << "Variable: " << pidxVars[v] << "\n"
+        << "Variable type name: " << variable->type_name << "\n"
+        << "Values per sample: " << valuesPerSample << "\n"
+        << "Bits per sample: " << bitsPerSample << std::endl;
+    }
+    const IDXVar idx_var = parse_idx_type(variable->type_name);
+    if (idx_var.components != 1) {
+      throw std::runtime_error("Unsupported # of components in type, "
+          "only scalar types are supported!");
+    }
 
-  if (rank == 0) {
-    std::cout << "Rank " << rank << " load time: " << loadTime << "s\n"
-      << "bandwidth: " << bandwidthMB << " MB/s\n";
-    const size_t totalBytes = fullDims.x * fullDims.y * fullDims.z * bytesPerSample * valuesPerSample;
-    std::cout << "Aggregate bandwidth: " << (totalBytes * 1e-6) / loadTime << " MB/s\n";
-  }
+    auto b = v == currentVariable ? brick : std::make_shared<VolumeBrick>();
+    b->voxelType = idx_var.type;
+    b->data.resize(bytesPerSample * valuesPerSample * nReadVals, 0);
+    if (amrLevels.empty()) {
+      PIDX_CHECK(PIDX_variable_read_data_layout(variable, pReadOffset, pReadSize,
+            b->data.data(), PIDX_row_major));
+      timings.bytesRead += b->data.size();
+    } else {
+      // The levels have the same variables, so read the same one from each
+      for (auto &level : amrLevels) {
+        level.data.push_back(std::vector<char>());
+        if (level.empty()) {
+          continue;
+        }
+        PIDX_variable levelVariable;
+        PIDX_CHECK(PIDX_set_current_variable_index(level.file, v));
+        PIDX_CHECK(PIDX_get_current_variable(level.file, &levelVariable));
+        level.data.back().resize(bytesPerSample * valuesPerSample
+            * level.size.x * level.size.y * level.size.z, 0);
+        PIDX_point pLevelOffset, pLevelDims;
+        PIDX_set_point(pLevelOffset, level.offset.x, level.offset.y, level.offset.z);
+        PIDX_set_point(pLevelDims, level.size.x, level.size.y, level.size.z);
+        PIDX_CHECK(PIDX_variable_read_data_layout(levelVariable, pLevelOffset,
+              pLevelDims, level.data.back().data(), PIDX_row_major));
+        timings.bytesRead += level.data.back().size();
+      }
+    }
 
-  if (idx_var.components != 1) {
-    throw std::runtime_error("Unsupported # of components in type, "
-        "only scalar types are supported!");
+    bricks.push_back(b);
+    voxelSizes.push_back(bytesPerSample * valuesPerSample);
   }
 
-  vec2f localValueRange = compute_volume_range(data, idx_var.type);
-  MPI_Allreduce(&localValueRange.x, &valueRange.x, 1, MPI_FLOAT,
-      MPI_MIN, MPI_COMM_WORLD);
-  MPI_Allreduce(&localValueRange.y, &valueRange.y, 1, MPI_FLOAT,
-      MPI_MAX, MPI_COMM_WORLD);
-  transferFunction.set("valueRange", valueRange);
-  transferFunction.commit();
+  // All the variables are read together when the file is closed, the
+  // layouts above just tell PIDX where to put them
+  for (int l = 0; l < amrLevel; ++l) {
+    PIDX_CHECK(PIDX_close(amrLevels[l].file));
+  }
+  PIDX_CHECK(PIDX_close(pidxFile));
+  // Fill in the bricks from the coarsest AMR level up, so the finer levels
+  // replace the coarse voxels where they exist
+  for (const auto &level : amrLevels) {
+    for (size_t i = 0; i < bricks.size(); ++i) {
+      if (!level.empty()) {
+        paste_amr_level(level, level.data[i], bricks[i]->data, readOffset,
+            readSize, voxelSizes[i]);
+      }
+    }
+  }
+  timings.lap(PHASE_READ, phaseStart);
 
-  if (rank == 0) {
-    std::cout << "Value range = " << valueRange << "\n";
+  if (exchangeGhosts) {
+    for (size_t i = 0; i < bricks.size(); ++i) {
+      pad_brick(bricks[i]->data, readSize, ghostLower, localDims, voxelSizes[i]);
+      exchange_ghosts(bricks[i]->data, localDims, ghostLower, ghostUpper, brickId,
+          grid, voxelSizes[i], comm);
+    }
   }
+  timings.lap(PHASE_GHOSTS, phaseStart);
 
-  volume.set("transferFunction", transferFunction);
-  // TODO: Parse the IDX type name into the OSPRay type name
-  volume.set("voxelType", idx_var.type);
-  // TODO: This will be the local dimensions later
-  volume.set("dimensions", vec3i(localDims));
-  volume.set("gridOrigin", vec3f(localOffset) - vec3f(fullDims) / 2.f);
-  // TODO: Use the logic box to figure out grid spacing
-  //volume.set("gridSpacing", vec3f(dimensions) / vec3f(ospDims));
+  const box3f region((vec3f(brickOffset) - vec3f(fullDims) / 2.f) * levelSpacing,
+      (vec3f(brickOffset + brickDims) - vec3f(fullDims) / 2.f) * levelSpacing);
+  const vec3sz readDims = localDims;
+  for (size_t i = 0; i < bricks.size(); ++i) {
+    VolumeBrick &b = *bricks[i];
+    // When reading a coarse level PIDX only fills in the voxels on that level's
+    // lattice, so pull those out into a dense brick
+    b.localDims = compact_strided(b.data, readDims, stride, voxelSizes[i]);
+    b.macrocells = compute_macrocells(b.data.data(), b.localDims, b.voxelType);
 
-  // Now we have some row-major data in the array we can pass to an OSPRay volume
-  volume.setRegion(data.data(), vec3i(0), vec3i(localDims));
-  volume.commit();
+    const BrickStats stats = compute_brick_stats(b.data.data(),
+        b.localDims.x * b.localDims.y * b.localDims.z, b.voxelType);
+    // Reduce the min and max together by negating the min
+    const vec2f localValueRange(-stats.range.x, stats.range.y);
+    MPI_Allreduce(&localValueRange.x, &b.valueRange.x, 2, MPI_FLOAT,
+        MPI_MAX, comm);
+    b.valueRange.x = -b.valueRange.x;
 
-  localRegion = box3f(vec3f(brickId * brickDims) - vec3f(fullDims) / 2.f,
-      vec3f(brickId * brickDims + brickDims) - vec3f(fullDims) / 2.f);
-}
+    // Bin our brick's values over the full range and merge the histograms
+    const std::vector<uint64_t> localHistogram = bin_histogram(stats.keyCounts,
+        b.voxelType, b.valueRange, HISTOGRAM_BINS);
+    b.histogram.resize(localHistogram.size(), 0);
+    MPI_Allreduce(localHistogram.data(), b.histogram.data(), b.histogram.size(),
+        MPI_UINT64_T, MPI_SUM, comm);
+
+    if (rank == 0) {
+      std::cout << pidxVars[readVariables[i]] << " value range = "
+        << b.valueRange << "\n";
+    }
+
+    // Convert to the storage type now that we have the stats of the full
+    // precision values and know the global range to quantize over
+    b.voxelRange = b.valueRange;
+    const bool floatingPoint = b.voxelType == "float" || b.voxelType == "double";
+    if (dataset.voxelStorage() == STORE_FLOAT && b.voxelType == "double") {
+      convert_voxels(b.data, b.voxelType, "float", b.valueRange);
+      b.voxelType = "float";
+    } else if (dataset.voxelStorage() == STORE_U16 && floatingPoint) {
+      convert_voxels(b.data, b.voxelType, "ushort", b.valueRange);
+      b.voxelType = "ushort";
+      b.voxelRange = vec2f(0.f, 65535.f);
+    }
 
+    b.fullDims = fullDims;
+    b.localOffset = localOffset;
+    b.stride = stride;
+    b.resolution = resolution;
+    b.maxResolution = maxResolution;
+    b.levelSpacing = levelSpacing;
+    b.localRegion = region;
+    timings.lap(PHASE_STATS, phaseStart);
+    if (cache) {
+      cache->insert(currentTimestep, pidxVars[readVariables[i]], coarsenLevels,
+          bricks[i]);
+    }
+    if (dataset.diskCache()) {
+      dataset.diskCache()->store(diskBrickKey(dataset, pidxVars[readVariables[i]],
+            coarsenLevels), b, pidxVars);
+    }
+    timings.lap(PHASE_STORE, phaseStart);
+  }
+  if (rank == 0 && resolution < maxResolution) {
+    std::cout << "Read HZ level " << resolution << " of " << maxResolution
+      << ", sample spacing " << stride << "\n";
+  }
+
+  useBrick();
+  timings.lap(PHASE_STATS, phaseStart);
+}
+void PIDXVolume::useBrick() {
+  fullDims = brick->fullDims;
+  localDims = brick->localDims;
+  localOffset = brick->localOffset;
+  stride = brick->stride;
+  resolution = brick->resolution;
+  maxResolution = brick->maxResolution;
+  levelSpacing = brick->levelSpacing;
+  localRegion = brick->localRegion;
+  valueRange = brick->valueRange;
+  voxelRange = brick->voxelRange;
+  histogram = brick->histogram;
+  macrocells = brick->macrocells;
+}
+std::string PIDXVolume::diskBrickKey(const PIDXDataset &dataset,
+    const std::string &variable, const int coarsenLevels) const
+{
+  int rank = 0;
+  int numRanks = 0;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numRanks);
+  // The brick depends on everything that picks which voxels we read and how
+  // they're stored, so a brick from a different setup is never reused. The
+  // AMR refinement ratio scales the coarser levels pasted into AMR bricks.
+  // The version of each IDX file read catches datasets rewritten in place.
+  const box3f &roi = dataset.normalizedRegionOfInterest();
+  std::stringstream key;
+  key << std::setprecision(9) << datasetPath << ";" << currentTimestep << ";"
+    << variable << ";" << coarsenLevels << ";" << rank << "/" << numRanks << ";"
+    << roi.lower.x << "," << roi.lower.y << "," << roi.lower.z << ","
+    << roi.upper.x << "," << roi.upper.y << "," << roi.upper.z << ";"
+    << dataset.voxelStorage() << ";" << dataset.ghostWidth() << ";"
+    << dataset.amrRefinement();
+  const int amrLevel = uintahLevel(datasetPath);
+  for (int l = 0; l < amrLevel; ++l) {
+    key << ";" << file_version(uintahLevelPath(datasetPath, l));
+  }
+  key << ";" << file_version(datasetPath);
+  return key.str();
+}
+bool PIDXVolume::visibleRegion(const std::vector<float> &opacities,
+    box3f &region) const
+{
+  const vec3f gridOrigin = (vec3f(localOffset) - vec3f(fullDims) / 2.f) * levelSpacing;
+  const vec3f gridSpacing = vec3f(stride) * levelSpacing;
+  const vec3sz &cells = macrocells.dims;
+  bool anyVisible = false;
+  vec3f lower(std::numeric_limits<float>::infinity());
+  vec3f upper(-std::numeric_limits<float>::infinity());
+  for (size_t z = 0; z < cells.z; ++z) {
+    for (size_t y = 0; y < cells.y; ++y) {
+      for (size_t x = 0; x < cells.x; ++x) {
+        const size_t c = (z * cells.y + y) * cells.x + x;
+        if (!range_visible(opacities, valueRange, macrocells.ranges[c])) {
+          continue;
+        }
+        const vec3sz lo = vec3sz(x, y, z) * macrocells.cellSize;
+        const vec3sz hi = ospcommon::min(lo + vec3sz(macrocells.cellSize),
+            localDims - vec3sz(1));
+        lower = ospcommon::min(lower, gridOrigin + vec3f(lo) * gridSpacing);
+        upper = ospcommon::max(upper, gridOrigin + vec3f(hi) * gridSpacing);
+        anyVisible = true;
+      }
+    }
+  }
+  if (!anyVisible) {
+    return false;
+  }
+  // The cells may extend into the ghost voxels, which we don't own
+  lower = ospcommon::max(lower, localRegion.lower);
+  upper = ospcommon::min(upper, localRegion.upper);
+  if (lower.x >= upper.x || lower.y >= upper.y || lower.z >= upper.z) {
+    return false;
+  }
+  region = box3f(lower, upper);
+  return true;
+}
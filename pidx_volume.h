@@ -2,10 +2,14 @@
 
 #include <vector>
 #include <string>
+#include <mpi.h>
 #include "ospray/ospray_cpp/Volume.h"
 #include "ospray/ospray_cpp/TransferFunction.h"
 #include "util.h"
 #include "pidx_util.h"
+#include "brick_cache.h"
+#include "pidx_dataset.h"
+#include "load_timings.h"
 #include "PIDX.h"
 
 struct IDXVar {
@@ -17,32 +21,107 @@ struct IDXVar {
 // of components of the type 'typename' in the type.
 IDXVar parse_idx_type(const std::string &type);
 
+/* Try reading a coarse HZ level of the timestep's variable with a few
+ * candidate I/O settings around the dataset's current ones, and keep the
+ * settings with the best aggregate read bandwidth on the dataset. Collective over the dataset
+ * session's communicator. Returns the settings picked.
+ */
+PIDXIOSettings autotune_io_settings(PIDXDataset &dataset, const std::string &path,
+    ospray::cpp::TransferFunction tfcn, const std::string &variable,
+    const size_t timestep);
+
 struct PIDXVolume {
   std::string datasetPath;
-  PIDX_access pidxAccess;
-  PIDX_file pidxFile;
-  PIDX_point pdims;
+  MPI_Comm comm;
   std::vector<std::string> pidxVars;
 
-  int resolution;
+  // The HZ level we've read up to and the finest HZ level of the dataset
+  int resolution, maxResolution;
   ospray::cpp::Volume volume;
   ospray::cpp::TransferFunction transferFunction;
-  vec3sz fullDims, localDims, localOffset;
+  // The local brick's samples are stride voxels apart, starting at localOffset
+  vec3sz fullDims, localDims, localOffset, stride;
+  // The size of a voxel in the world, where level 0 AMR voxels are one unit
+  float levelSpacing;
+  // The type of the uploaded voxels, as OSPRay names it
+  std::string voxelType;
   ospcommon::box3f localRegion;
   ospcommon::vec2f valueRange;
+  // The range the transfer function is mapped over, the range of the
+  // quantized values if we quantized the variable
+  ospcommon::vec2f voxelRange;
+  // Histogram of the variable's values over all the bricks
+  std::vector<uint64_t> histogram;
+  // Value ranges over coarse cells of the local brick
+  MacrocellGrid macrocells;
+  // The brick loaded for this rank, held until it's uploaded to OSPRay, or
+  // for the lifetime of the volume if the volume shares it
+  std::shared_ptr<VolumeBrick> brick;
+  BrickCache *cache;
+  // How long this rank spent in each phase of loading the volume, and if
+  // the brick was read from PIDX instead of found in a cache, which every
+  // rank agrees on
+  LoadTimings timings;
+  bool readFromPIDX;
 
   // UI data
   std::string currentVariableName;
   int currentVariable;
   size_t currentTimestep;
 
-  PIDXVolume(const std::string &path, ospray::cpp::TransferFunction tfcn,
-      const std::string &currentVariableName, size_t currentTimestep);
+  /* Read the brick of the dataset file at path owned by this rank. The read
+   * is collective over the dataset session's communicator and makes no OSPRay
+   * calls, so volumes can be loaded on a background thread with their own
+   * session. Call upload on the rendering thread to make the OSPRay volume
+   * before rendering it.
+   * If a brick cache is passed, bricks found in it on every rank are used
+   * without reading from PIDX, in which case pidxVars is only filled if the
+   * dataset session has opened a file before. The same goes for the dataset
+   * session's disk cache, which is checked after the brick cache and keeps
+   * the variables the bricks were read with.
+   * The finest coarsenLevels HZ levels are skipped, to quickly read a coarse
+   * version of the volume.
+   * If path is to a refined Uintah AMR level, the coarser levels next to it
+   * are read where the level isn't refined and upsampled to fill in the
+   * volume at the level's resolution. HZ coarsening isn't done for AMR
+   * levels, they're all read at full resolution.
+   * The siblingVariables are read along with the current variable in the
+   * same file session and put in the brick cache, so switching to them
+   * later doesn't go back to PIDX. They're only read if there's a cache.
+   */
+  PIDXVolume(PIDXDataset &dataset, const std::string &path,
+      ospray::cpp::TransferFunction tfcn,
+      const std::string &currentVariableName, size_t currentTimestep,
+      BrickCache *cache = nullptr, int coarsenLevels = 0,
+      const std::vector<std::string> &siblingVariables = std::vector<std::string>());
   PIDXVolume(const PIDXVolume &p) = delete;
   PIDXVolume& operator=(const PIDXVolume &p) = delete;
   ~PIDXVolume();
 
+  /* Create and commit the OSPRay volume from the loaded brick data. If
+   * shareBrick is set the volume renders directly from the brick instead of
+   * copying it, halving the memory used and skipping the copy. Bricks mapped
+   * from the disk cache are always shared.
+   * If the volume was read from PIDX the timings of loading it are then
+   * reported across the ranks, so this must be called on the rendering
+   * thread as it's collective over MPI_COMM_WORLD.
+   */
+  void upload(const bool shareBrick = false);
+
+  /* Find the part of this rank's region containing voxels given non-zero
+   * opacity by the transfer function opacities, which are spread over the
+   * volume's value range. Returns false if the whole brick is transparent.
+   */
+  bool visibleRegion(const std::vector<float> &opacities,
+      ospcommon::box3f &region) const;
+
 private:
-  void update();
+  void update(PIDXDataset &dataset, int coarsenLevels,
+      const std::vector<std::string> &siblingVariables);
+  // Set the volume's info from the brick's
+  void useBrick();
+  // The key this rank's brick of the variable is kept under in the disk cache
+  std::string diskBrickKey(const PIDXDataset &dataset, const std::string &variable,
+      const int coarsenLevels) const;
 };
 
@@ -0,0 +1,197 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include "timestep_loader.h"
+
+using namespace ospray::cpp;
+using namespace ospcommon;
+
+TimestepLoader::TimestepLoader(const std::set<UintahTimestep> &timesteps,
+    TransferFunction tfcn, size_t maxBuffered, MPI_Comm comm,
+    BrickCache *cache, int prefetchCoarsenLevels,
+    const std::vector<std::string> &siblingVariables,
+    const PIDXDataset *settings)
+  : timesteps(timesteps), transferFunction(tfcn), maxBuffered(maxBuffered),
+  cache(cache), prefetchCoarsenLevels(prefetchCoarsenLevels),
+  siblingVariables(siblingVariables), comm(comm),
+  refining(false), refinementDone(false), quit(false)
+{
+  MPI_Comm_dup(comm, &loaderComm);
+  dataset = ospcommon::make_unique<PIDXDataset>(loaderComm);
+  if (settings) {
+    dataset->copySettings(*settings);
+  }
+  loaderThread = std::thread([&](){ loaderLoop(); });
+}
+TimestepLoader::~TimestepLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  cond.notify_all();
+  loaderThread.join();
+  dataset = nullptr;
+  MPI_Comm_free(&loaderComm);
+}
+void TimestepLoader::prefetch(size_t timestep, int direction,
+    const std::string &variable)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (variable != requestedVariable) {
+      requested.clear();
+      loaded.clear();
+      requestedVariable = variable;
+    }
+
+    // Find the timesteps we want buffered, nearest first
+    std::vector<std::set<UintahTimestep>::const_iterator> wanted;
+    auto t = timesteps.find(UintahTimestep(timestep, ""));
+    while (t != timesteps.end() && wanted.size() < maxBuffered) {
+      if (direction < 0) {
+        if (t == timesteps.begin()) {
+          break;
+        }
+        --t;
+      } else {
+        ++t;
+        if (t == timesteps.end()) {
+          break;
+        }
+      }
+      wanted.push_back(t);
+    }
+
+    // Drop timesteps we've scrubbed away from, reads for them which are still
+    // queued or in progress will be discarded once they finish
+    for (auto r = requested.begin(); r != requested.end();) {
+      auto w = std::find_if(wanted.begin(), wanted.end(),
+          [&](const std::set<UintahTimestep>::const_iterator &w) {
+            return w->timestep == *r;
+          });
+      if (w == wanted.end()) {
+        loaded.erase(*r);
+        r = requested.erase(r);
+      } else {
+        ++r;
+      }
+    }
+    for (const auto &w : wanted) {
+      if (requested.find(w->timestep) == requested.end()) {
+        requested.insert(w->timestep);
+        queue.push_back(Request{w->timestep, w->levelPath(dataset->amrLevel()),
+            variable, prefetchCoarsenLevels, false});
+      }
+    }
+  }
+  cond.notify_all();
+}
+std::shared_ptr<PIDXVolume> TimestepLoader::take(size_t timestep,
+    const std::string &variable)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  if (variable != requestedVariable
+      || requested.find(timestep) == requested.end())
+  {
+    return nullptr;
+  }
+  cond.wait(lock, [&](){ return loaded.find(timestep) != loaded.end(); });
+  auto volume = loaded[timestep];
+  loaded.erase(timestep);
+  requested.erase(timestep);
+  return volume;
+}
+void TimestepLoader::refine(const std::string &path, size_t timestep,
+    const std::string &variable, int coarsenLevels)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    refinementTarget = Request{timestep, path, variable, coarsenLevels, true};
+    refining = true;
+    refinementDone = false;
+    refined = nullptr;
+    queue.push_back(refinementTarget);
+  }
+  cond.notify_all();
+}
+bool TimestepLoader::pollRefinement(std::shared_ptr<PIDXVolume> &volume) {
+  int done = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = refining && refinementDone ? 1 : 0;
+  }
+  // The refinement may have finished on some ranks before others, only swap
+  // it in once it's done everywhere so we all render the same volume
+  int allDone = 0;
+  MPI_Allreduce(&done, &allDone, 1, MPI_INT, MPI_MIN, comm);
+  if (!allDone) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  volume = refined;
+  refined = nullptr;
+  refining = false;
+  refinementDone = false;
+  return true;
+}
+void TimestepLoader::cancelRefinement() {
+  std::lock_guard<std::mutex> lock(mutex);
+  refining = false;
+  refinementDone = false;
+  refined = nullptr;
+}
+void TimestepLoader::loaderLoop() {
+  while (true) {
+    Request req;
+    int quitting = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&](){ return quit || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      req = queue.front();
+      queue.pop_front();
+      quitting = quit ? 1 : 0;
+    }
+
+    // The queue is the same on all ranks but some may have started shutting
+    // down, agree on whether to do the read so we don't hang in it
+    int anyQuitting = 0;
+    MPI_Allreduce(&quitting, &anyQuitting, 1, MPI_INT, MPI_MAX, loaderComm);
+    if (anyQuitting) {
+      continue;
+    }
+
+    std::shared_ptr<PIDXVolume> volume;
+    try {
+      volume = std::make_shared<PIDXVolume>(*dataset, req.path,
+          transferFunction, req.variable, req.timestep, cache,
+          req.coarsenLevels, siblingVariables);
+    } catch (const std::exception &e) {
+      // A null volume tells take to load the timestep directly instead
+      std::cerr << "Failed to load timestep " << req.timestep
+        << " in the background: " << e.what() << std::endl;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (req.refinement) {
+        if (refining && req.timestep == refinementTarget.timestep
+            && req.variable == refinementTarget.variable
+            && req.coarsenLevels == refinementTarget.coarsenLevels)
+        {
+          refined = volume;
+          refinementDone = true;
+        }
+      } else if (req.variable == requestedVariable
+          && requested.find(req.timestep) != requested.end())
+      {
+        loaded[req.timestep] = volume;
+      }
+    }
+    cond.notify_all();
+  }
+}
+
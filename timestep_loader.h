@@ -0,0 +1,104 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include "ospray/ospray_cpp/TransferFunction.h"
+#include "util.h"
+#include "pidx_volume.h"
+
+/* Loads the timesteps following the one being rendered on a background
+ * thread, so scrubbing through the timesteps in order doesn't stop rendering
+ * for the whole PIDX read. Also reads finer resolution versions of the volume
+ * being rendered in the background, for progressive refinement. The reads are
+ * collective over a communicator duplicated from the one passed, so all ranks
+ * must make the same sequence of calls to the loader. MPI must be initialized
+ * with MPI_THREAD_MULTIPLE.
+ */
+class TimestepLoader {
+  struct Request {
+    size_t timestep;
+    std::string path;
+    std::string variable;
+    int coarsenLevels;
+    bool refinement;
+  };
+
+  std::set<UintahTimestep> timesteps;
+  ospray::cpp::TransferFunction transferFunction;
+  size_t maxBuffered;
+  BrickCache *cache;
+  int prefetchCoarsenLevels;
+  std::vector<std::string> siblingVariables;
+  MPI_Comm comm, loaderComm;
+  // The loader thread's own dataset session, on loaderComm
+  std::unique_ptr<PIDXDataset> dataset;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  // The timesteps we've requested and not dropped or taken. These only change
+  // on prefetch and take so they're the same on all ranks.
+  std::set<size_t> requested;
+  std::string requestedVariable;
+  std::deque<Request> queue;
+  std::map<size_t, std::shared_ptr<PIDXVolume>> loaded;
+  // The refinement we're waiting on, if any
+  bool refining, refinementDone;
+  Request refinementTarget;
+  std::shared_ptr<PIDXVolume> refined;
+  bool quit;
+
+  std::thread loaderThread;
+
+public:
+  /* Prefetched timesteps are read with the finest prefetchCoarsenLevels HZ
+   * levels dropped, to be refined once they're being rendered. The
+   * siblingVariables are read into the cache along with each volume. If
+   * settings is passed the loader reads with the same region of interest,
+   * voxel storage and I/O settings as that session.
+   */
+  TimestepLoader(const std::set<UintahTimestep> &timesteps,
+      ospray::cpp::TransferFunction tfcn, size_t maxBuffered,
+      MPI_Comm comm = MPI_COMM_WORLD, BrickCache *cache = nullptr,
+      int prefetchCoarsenLevels = 0,
+      const std::vector<std::string> &siblingVariables = std::vector<std::string>(),
+      const PIDXDataset *settings = nullptr);
+  ~TimestepLoader();
+  TimestepLoader(const TimestepLoader &) = delete;
+  TimestepLoader& operator=(const TimestepLoader &) = delete;
+
+  /* Start loading the maxBuffered timesteps after timestep, in the scrub
+   * direction (+1 or -1). Previously buffered timesteps which aren't in this
+   * window anymore are dropped.
+   */
+  void prefetch(size_t timestep, int direction, const std::string &variable);
+  /* Take the prefetched volume for the timestep, waiting for its read to
+   * finish if it's still loading. Returns null if the timestep wasn't
+   * prefetched, in which case the caller should load it directly.
+   */
+  std::shared_ptr<PIDXVolume> take(size_t timestep, const std::string &variable);
+  /* Queue a read of the dataset with the finest coarsenLevels HZ levels
+   * dropped, replacing any refinement we were waiting on.
+   */
+  void refine(const std::string &path, size_t timestep,
+      const std::string &variable, int coarsenLevels);
+  /* Check if the queued refinement has been read on all ranks, without
+   * waiting for it. Returns true if it's done, in which case refined is set
+   * to the volume, or null if the read failed. Collective over the
+   * communicator the loader was made with.
+   */
+  bool pollRefinement(std::shared_ptr<PIDXVolume> &refined);
+  // Stop waiting on the queued refinement, it'll be discarded once read
+  void cancelRefinement();
+
+private:
+  void loaderLoop();
+};
+
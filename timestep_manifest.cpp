@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "timestep_manifest.h"
+
+const std::string MANIFEST_HEADER = "# PIDX timestep manifest v2";
+
+// Get the modification time of the directory, throws if it can't be stat'd
+time_t directory_mtime(const std::string &dir) {
+  struct stat dirStat = {0};
+  if (stat(dir.c_str(), &dirStat) != 0) {
+    throw std::runtime_error("failed to open directory: " + dir);
+  }
+  return dirStat.st_mtime;
+}
+
+/* Write a line "timestep <timestep> <path>" for each timestep, followed by a
+ * line "level <level> <path>" for each of its refined AMR levels. This is
+ * used for both the manifest and broadcasting the timesteps.
+ */
+void write_timesteps(std::ostream &os, const std::set<UintahTimestep> &timesteps) {
+  for (const auto &t : timesteps) {
+    os << "timestep " << t.timestep << " " << t.path << "\n";
+    for (size_t l = 1; l < t.levels.size(); ++l) {
+      os << "level " << l << " " << t.levels[l] << "\n";
+    }
+  }
+}
+
+/* Parse a line written by write_timesteps, adding it to the timesteps. Lines
+ * of other kinds are returned in kind, value and path for the caller to
+ * handle. Returns false if the line is malformed.
+ */
+bool read_timestep_line(const std::string &line, std::vector<UintahTimestep> &timesteps,
+    std::string &kind, long long &value, std::string &path)
+{
+  std::stringstream fields(line);
+  if (!(fields >> kind >> value)) {
+    return false;
+  }
+  fields.ignore(1);
+  std::getline(fields, path);
+  if (kind == "timestep") {
+    timesteps.emplace_back(static_cast<size_t>(value), path);
+  } else if (kind == "level") {
+    if (timesteps.empty() || timesteps.back().levels.size() != static_cast<size_t>(value)) {
+      return false;
+    }
+    timesteps.back().levels.push_back(path);
+  }
+  return true;
+}
+
+/* Load the timesteps from the manifest if it's for the dirs as they are now.
+ * The manifest has a line "dir <mtime> <path>" for each dir followed by the
+ * timesteps' lines.
+ */
+bool load_manifest(const std::string &manifestPath, const std::vector<std::string> &dirs,
+    const std::vector<time_t> &mtimes, std::set<UintahTimestep> &timesteps)
+{
+  std::ifstream file(manifestPath.c_str());
+  std::string line;
+  if (!std::getline(file, line) || line != MANIFEST_HEADER) {
+    return false;
+  }
+  size_t nextDir = 0;
+  std::vector<UintahTimestep> found;
+  while (std::getline(file, line)) {
+    std::string kind, path;
+    long long value = 0;
+    if (!read_timestep_line(line, found, kind, value, path)) {
+      return false;
+    }
+    if (kind == "dir") {
+      if (nextDir >= dirs.size() || dirs[nextDir] != path
+          || mtimes[nextDir] != static_cast<time_t>(value))
+      {
+        return false;
+      }
+      ++nextDir;
+    } else if (kind != "timestep" && kind != "level") {
+      return false;
+    }
+  }
+  timesteps.insert(found.begin(), found.end());
+  return nextDir == dirs.size();
+}
+
+void write_manifest(const std::string &manifestPath, const std::vector<std::string> &dirs,
+    const std::vector<time_t> &mtimes, const std::set<UintahTimestep> &timesteps)
+{
+  const std::string tmpPath = manifestPath + ".tmp";
+  {
+    std::ofstream file(tmpPath.c_str());
+    file << MANIFEST_HEADER << "\n";
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      file << "dir " << static_cast<long long>(mtimes[i]) << " " << dirs[i] << "\n";
+    }
+    write_timesteps(file, timesteps);
+    if (!file) {
+      std::cerr << "Failed to write timestep manifest " << tmpPath << "\n";
+      std::remove(tmpPath.c_str());
+      return;
+    }
+  }
+  if (std::rename(tmpPath.c_str(), manifestPath.c_str()) != 0) {
+    std::cerr << "Failed to move timestep manifest into place at " << manifestPath << "\n";
+    std::remove(tmpPath.c_str());
+  }
+}
+
+std::set<UintahTimestep> scan_timesteps(const std::vector<std::string> &dirs,
+    const std::string &manifestPath)
+{
+  if (manifestPath.empty()) {
+    return collectUintahTimesteps(dirs);
+  }
+
+  const time_t scanStart = std::time(nullptr);
+  std::vector<time_t> mtimes;
+  for (const auto &d : dirs) {
+    mtimes.push_back(directory_mtime(d));
+  }
+  std::set<UintahTimestep> timesteps;
+  if (load_manifest(manifestPath, dirs, mtimes, timesteps)) {
+    std::cout << "Loaded " << timesteps.size() << " timesteps from manifest "
+      << manifestPath << "\n";
+    return timesteps;
+  }
+
+  timesteps = collectUintahTimesteps(dirs);
+  // The mtimes only have second resolution, so don't save the manifest if a
+  // dir changed in the second we scanned it, since later changes in the same
+  // second wouldn't invalidate it
+  bool settled = true;
+  for (const auto &m : mtimes) {
+    settled = settled && m < scanStart;
+  }
+  if (settled) {
+    write_manifest(manifestPath, dirs, mtimes, timesteps);
+  }
+  return timesteps;
+}
+
+std::set<UintahTimestep> share_uintah_timesteps(const std::vector<std::string> &dirs,
+    MPI_Comm comm, const std::string &manifestPath)
+{
+  int rank = 0;
+  MPI_Comm_rank(comm, &rank);
+
+  // Rank 0 sends the timesteps in the manifest's format, or an error message
+  // if it failed to scan so the other ranks fail with it
+  int failed = 0;
+  std::string message;
+  if (rank == 0) {
+    try {
+      std::stringstream lines;
+      write_timesteps(lines, scan_timesteps(dirs, manifestPath));
+      message = lines.str();
+    } catch (const std::exception &e) {
+      failed = 1;
+      message = e.what();
+    }
+  }
+  unsigned long long messageSize = message.size();
+  MPI_Bcast(&failed, 1, MPI_INT, 0, comm);
+  MPI_Bcast(&messageSize, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
+  message.resize(messageSize);
+  MPI_Bcast(&message[0], messageSize, MPI_CHAR, 0, comm);
+  if (failed) {
+    throw std::runtime_error(message);
+  }
+
+  std::vector<UintahTimestep> timesteps;
+  std::stringstream lines(message);
+  std::string line, kind, path;
+  long long value = 0;
+  while (std::getline(lines, line)) {
+    read_timestep_line(line, timesteps, kind, value, path);
+  }
+  return std::set<UintahTimestep>(timesteps.begin(), timesteps.end());
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+#include <mpi.h>
+#include "util.h"
+
+/* Collect the Uintah timesteps in the dirs on rank 0 of comm and broadcast
+ * them to the other ranks, so the filesystem's metadata servers only see one
+ * scan. Collective over comm.
+ * If manifestPath is set rank 0 loads the timesteps from the manifest file
+ * instead of scanning, as long as the dirs and their modification times
+ * match the ones it was written for. Otherwise the dirs are scanned and the
+ * manifest rewritten. Since only the dirs' own modification times are
+ * checked, timesteps whose CCVars.idx shows up after their directory was
+ * created are missed until the manifest is removed.
+ */
+std::set<UintahTimestep> share_uintah_timesteps(const std::vector<std::string> &dirs,
+    MPI_Comm comm, const std::string &manifestPath = "");
+
@@ -1,4 +1,8 @@
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,34 +13,68 @@
 
 using namespace ospcommon;
 
-AppState::AppState() : fbSize(1024), cameraChanged(false), quit(false),
-  fbSizeChanged(false), tfcnChanged(false), timestepChanged(false),
-  fieldChanged(false)
+AppState::AppState() : fbSize(1024), roi(vec3f(0.f), vec3f(1.f)),
+  cameraChanged(false), quit(false), fbSizeChanged(false), tfcnChanged(false),
+  timestepChanged(false), fieldChanged(false), roiChanged(false)
 {}
 
-bool computeDivisor(int x, int &divisor) {
-  int upperBound = std::sqrt(x);
-  for (int i = 2; i <= upperBound; ++i) {
-    if (x % i == 0) {
-      divisor = i;
-      return true;
+WorkerStatus::WorkerStatus() : frameTime(0), width(0), height(0),
+  residentLevel(0), maxLevel(0), amrLevel(0), amrLevels(1), newHistogram(false),
+  variance(0.f), converged(false), targetFps(0.f), spp(1), samplingRate(0.f)
+{}
+
+vec3i computeGrid(int num, const vec3sz &dims) {
+  vec3i best(0);
+  size_t bestVoxels = std::numeric_limits<size_t>::max();
+  size_t bestSurface = std::numeric_limits<size_t>::max();
+  for (int x = 1; x <= num; ++x) {
+    if (num % x != 0) {
+      continue;
+    }
+    for (int y = 1; y <= num / x; ++y) {
+      if ((num / x) % y != 0) {
+        continue;
+      }
+      const vec3i grid(x, y, num / (x * y));
+      if (size_t(grid.x) > dims.x || size_t(grid.y) > dims.y
+          || size_t(grid.z) > dims.z)
+      {
+        continue;
+      }
+      // The largest brick gets the remainder voxels and ghost voxels on
+      // both sides along each axis split more than twice
+      size_t voxels = 1;
+      for (size_t i = 0; i < 3; ++i) {
+        const size_t ghosts = std::min(grid[i] - 1, 2);
+        voxels *= (dims[i] + grid[i] - 1) / grid[i] + ghosts;
+      }
+      // The area of the interior faces between bricks
+      const size_t surface = (grid.x - 1) * dims.y * dims.z
+        + (grid.y - 1) * dims.x * dims.z
+        + (grid.z - 1) * dims.x * dims.y;
+      if (voxels < bestVoxels || (voxels == bestVoxels && surface < bestSurface)) {
+        best = grid;
+        bestVoxels = voxels;
+        bestSurface = surface;
+      }
     }
   }
-  return false;
-}
-vec3i computeGrid(int num) {
-  vec3i grid(1);
-  int axis = 0;
-  int divisor = 0;
-  while (computeDivisor(num, divisor)) {
-    grid[axis] *= divisor;
-    num /= divisor;
-    axis = (axis + 1) % 3;
+  if (best.x == 0) {
+    throw std::runtime_error("Can't split the volume into "
+        + std::to_string(num) + " bricks, there are more ranks than voxels");
   }
-  if (num != 1) {
-    grid[axis] *= num;
+  return best;
+}
+void computeBrickBounds(const vec3i &brickId, const vec3i &grid,
+    const vec3sz &dims, vec3sz &offset, vec3sz &size)
+{
+  for (size_t i = 0; i < 3; ++i) {
+    const size_t base = dims[i] / grid[i];
+    const size_t remainder = dims[i] % grid[i];
+    const size_t id = brickId[i];
+    offset[i] = id * base + std::min(id, remainder);
+    size[i] = base + (id < remainder ? 1 : 0);
   }
-  return grid;
 }
 
 std::array<int, 3> computeGhostFaces(const vec3i &brickId, const vec3i &grid) {
@@ -53,8 +91,11 @@ std::array<int, 3> computeGhostFaces(const vec3i &brickId, const vec3i &grid) {
 }
 
 UintahTimestep::UintahTimestep(const size_t timestep, const std::string &path)
-  : timestep(timestep), path(path)
+  : timestep(timestep), path(path), levels(1, path)
 {}
+const std::string& UintahTimestep::levelPath(const int level) const {
+  return levels[std::min(static_cast<size_t>(std::max(level, 0)), levels.size() - 1)];
+}
 bool operator<(const UintahTimestep &a, const UintahTimestep &b) {
   return a.timestep < b.timestep;
 }
@@ -68,14 +109,85 @@ std::set<UintahTimestep> collectUintahTimesteps(const std::vector<std::string> &
     }
 
     for (dirent *e = readdir(dp); e; e = readdir(dp)) {
+      // Only stat the timestep directories, to keep the metadata traffic on
+      // large directories down
+      if (e->d_name[0] != 't' || (e->d_type != DT_DIR && e->d_type != DT_UNKNOWN)) {
+        continue;
+      }
       const std::string idxFile = dir + "/" + std::string(e->d_name) + "/l0/CCVars.idx";
       struct stat fileStat = {0};
       if (stat(idxFile.c_str(), &fileStat) == 0) {
         // The timestep files are in the pattern t######, so take out the t
-        const std::string fname = e->d_name + 1;
-        timesteps.emplace(size_t(std::stoull(e->d_name + 1)), idxFile);
+        UintahTimestep t(size_t(std::stoull(e->d_name + 1)), idxFile);
+        // The refined AMR levels are in l1, l2, ... next to l0
+        for (int l = 1;; ++l) {
+          const std::string levelFile = uintahLevelPath(idxFile, l);
+          if (stat(levelFile.c_str(), &fileStat) != 0) {
+            break;
+          }
+          t.levels.push_back(levelFile);
+        }
+        timesteps.insert(t);
       }
     }
+    closedir(dp);
   }
   return timesteps;
 }
+
+// Find the start and end of the level directory name in a path to a Uintah
+// level's CCVars.idx, returns false if it's not a Uintah level path
+bool find_level_dir(const std::string &path, size_t &begin, size_t &end) {
+  const std::string file = "/CCVars.idx";
+  if (path.size() <= file.size()
+      || path.compare(path.size() - file.size(), file.size(), file) != 0)
+  {
+    return false;
+  }
+  end = path.size() - file.size();
+  const size_t slash = path.rfind('/', end - 1);
+  begin = slash == std::string::npos ? 0 : slash + 1;
+  return end - begin > 1 && path[begin] == 'l'
+    && path.find_first_not_of("0123456789", begin + 1) == end;
+}
+int uintahLevel(const std::string &path) {
+  size_t begin = 0;
+  size_t end = 0;
+  if (!find_level_dir(path, begin, end)) {
+    return 0;
+  }
+  return std::stoi(path.substr(begin + 1, end - begin - 1));
+}
+std::string uintahLevelPath(const std::string &path, const int level) {
+  size_t begin = 0;
+  size_t end = 0;
+  if (!find_level_dir(path, begin, end)) {
+    return path;
+  }
+  return path.substr(0, begin + 1) + std::to_string(level) + path.substr(end);
+}
+int selectAMRLevel(const ospcommon::vec3f &eye, const ospcommon::box3f &bounds,
+    const float fovy, const int fbHeight, const int refinement,
+    const int numLevels, const int currentLevel)
+{
+  // Find the size of a pixel at the part of the volume nearest the camera,
+  // level 0 voxels are one unit across
+  const vec3f nearest = max(bounds.lower, min(eye, bounds.upper));
+  const float distance = length(eye - nearest);
+  const float pixelSize = 2.f * distance * std::tan(fovy * 0.5f * M_PI / 180.f) / fbHeight;
+  // The coarsest level whose voxels are at most the given size
+  auto levelFor = [&](const float voxelSize) {
+    if (voxelSize <= 0.f) {
+      return numLevels - 1;
+    }
+    const float level = std::ceil(-std::log(voxelSize) / std::log(float(refinement)));
+    return std::min(std::max(static_cast<int>(level), 0), numLevels - 1);
+  };
+  const int level = levelFor(pixelSize);
+  if (level >= currentLevel) {
+    return level;
+  }
+  // Only drop to a coarser level once its voxels are well under a pixel, so
+  // small camera motions around the threshold don't keep reloading the volume
+  return std::max(level, std::min(currentLevel, levelFor(pixelSize * 0.5f)));
+}
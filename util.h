@@ -2,8 +2,10 @@
 
 #include <array>
 #include <set>
+#include <string>
 #include <vector>
 #include "ospcommon/vec.h"
+#include "ospcommon/box.h"
 
 using vec3sz = ospcommon::vec_t<size_t, 3>;
 
@@ -13,12 +15,39 @@ struct AppState {
   std::array<ospcommon::vec3f, 3> v;
   ospcommon::vec2i fbSize;
   size_t currentTimestep;
+  // The region of the volume to load, normalized to [0, 1] over the volume
+  ospcommon::box3f roi;
   bool cameraChanged, quit, fbSizeChanged,
-       tfcnChanged, timestepChanged, fieldChanged;
+       tfcnChanged, timestepChanged, fieldChanged, roiChanged;
 
   AppState();
 };
 
+// Struct for sending the worker's status back to the viewer with each frame
+struct WorkerStatus {
+  int frameTime;
+  // The size the frame was rendered at, which is smaller than the window's
+  // while the camera is moving
+  int width, height;
+  // The HZ level of the volume being rendered and the dataset's finest level
+  int residentLevel, maxLevel;
+  // The Uintah AMR level being rendered and the number of levels available
+  int amrLevel, amrLevels;
+  // If the volume changed, the histogram of its values is sent after the frame
+  bool newHistogram;
+  // The frame's variance, and if it's below the threshold so the workers
+  // have stopped rendering until the app state changes
+  float variance;
+  bool converged;
+  // The frame rate the workers are aiming for, or 0 if they aren't, and the
+  // passes per frame and sampling rate they picked for it
+  float targetFps;
+  int spp;
+  float samplingRate;
+
+  WorkerStatus();
+};
+
 // Struct for holding the other app data buffers and info that
 // we can't bcast directly.
 struct AppData {
@@ -35,13 +64,22 @@ enum GhostFace {
   NEG_FACE = 1 << 1,
 };
 
-bool computeDivisor(int x, int &divisor);
+/* Compute an X x Y x Z grid of num bricks to split a volume of size dims
+ * over. Every factorization of num is tried and we pick the one whose largest
+ * brick, including its ghost voxels, is smallest, breaking ties by the
+ * surface area between the bricks. This keeps the per-rank brick sizes
+ * balanced and the bricks close to cubes for any number of ranks.
+ */
+ospcommon::vec3i computeGrid(int num, const vec3sz &dims);
 
-/* Compute an X x Y x Z grid to have num bricks,
- * only gives a nice grid for numbers with even factors since
- * we don't search for factors of the number, we just try dividing by two
+/* Compute the offset and size of the brick in the grid, not including ghost
+ * voxels. Voxels left over when the grid doesn't evenly divide the volume are
+ * spread over the first bricks along each axis, so every voxel is owned by
+ * exactly one brick and brick sizes differ by at most one voxel per axis.
  */
-ospcommon::vec3i computeGrid(int num);
+void computeBrickBounds(const ospcommon::vec3i &brickId,
+    const ospcommon::vec3i &grid, const vec3sz &dims,
+    vec3sz &offset, vec3sz &size);
 
 /* Compute which faces of this brick we need to specify ghost voxels for,
  * to have correct interpolation at brick boundaries. Returns mask of
@@ -52,10 +90,33 @@ std::array<int, 3> computeGhostFaces(const ospcommon::vec3i &brickId,
 
 struct UintahTimestep {
   size_t timestep;
+  // The CCVars.idx of the coarsest AMR level
   std::string path;
+  // The CCVars.idx of each AMR level, coarsest first
+  std::vector<std::string> levels;
   UintahTimestep(const size_t timestep, const std::string &path);
+  // Get the path of the level, or of the finest level if there are fewer levels
+  const std::string& levelPath(const int level) const;
 };
 
 bool operator<(const UintahTimestep &a, const UintahTimestep &b);
 
+// Scan the directories for the Uintah timestep directories with a PIDX
+// CCVars.idx file. See share_uintah_timesteps to scan once for all ranks.
 std::set<UintahTimestep> collectUintahTimesteps(const std::vector<std::string> &dirs);
+
+// Get the AMR level of the Uintah level CCVars.idx at path, i.e. N for a path
+// ending in lN/CCVars.idx, or 0 if the path isn't in a level directory
+int uintahLevel(const std::string &path);
+// Get the path of the level's CCVars.idx next to the Uintah level at path
+std::string uintahLevelPath(const std::string &path, const int level);
+
+/* Pick the AMR level to load for the view, the coarsest level whose voxels
+ * are no bigger than a pixel at the part of the volume nearest the eye.
+ * bounds are the volume's bounds in units of level 0 voxels, with each level
+ * refining the one before by refinement along each axis. The currentLevel is
+ * kept until the view has moved well past the threshold for a coarser one.
+ */
+int selectAMRLevel(const ospcommon::vec3f &eye, const ospcommon::box3f &bounds,
+    const float fovy, const int fbHeight, const int refinement,
+    const int numLevels, const int currentLevel);
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "ospcommon/tasking/parallel_for.h"
+#include "volume_stats.h"
+
+using namespace ospcommon;
+
+// The voxels are split into at most this many blocks, one task per block,
+// with each block's histogram taking 256KB in the worst case
+const size_t MAX_STATS_BLOCKS = 64;
+const size_t MIN_STATS_BLOCK_SIZE = 1 << 20;
+
+// Sortable histogram keys for each voxel type. The 8 and 16 bit types
+// are binned exactly, floating point values by their sign, exponent and
+// top mantissa bits.
+inline uint32_t histogram_key(const uint8_t x) {
+  return x;
+}
+inline uint32_t histogram_key(const int16_t x) {
+  return static_cast<uint32_t>(static_cast<int32_t>(x) + 32768);
+}
+inline uint32_t histogram_key(const uint16_t x) {
+  return x;
+}
+inline uint32_t histogram_key(const float x) {
+  uint32_t bits = 0;
+  std::memcpy(&bits, &x, sizeof(float));
+  // Flip negative values so the bits sort in the same order as the floats
+  bits = bits & 0x80000000 ? ~bits : bits | 0x80000000;
+  return bits >> 16;
+}
+inline uint32_t histogram_key(const double x) {
+  return histogram_key(static_cast<float>(x));
+}
+
+// Get the value in the middle of the range of values with the key
+float histogram_key_value(const uint32_t key, const std::string &voxelType) {
+  if (voxelType == "uchar" || voxelType == "ushort") {
+    return key;
+  } else if (voxelType == "short") {
+    return static_cast<float>(static_cast<int32_t>(key) - 32768);
+  }
+  uint32_t bits = (key << 16) | 0x8000;
+  bits = bits & 0x80000000 ? bits & 0x7fffffff : ~bits;
+  float x = 0;
+  std::memcpy(&x, &bits, sizeof(float));
+  return x;
+}
+
+size_t voxel_size(const std::string &voxelType) {
+  if (voxelType == "uchar") {
+    return 1;
+  } else if (voxelType == "short" || voxelType == "ushort") {
+    return 2;
+  } else if (voxelType == "float") {
+    return 4;
+  } else if (voxelType == "double") {
+    return 8;
+  }
+  throw std::runtime_error("Unsupported voxel type " + voxelType);
+}
+
+size_t histogram_key_count(const std::string &voxelType) {
+  return voxelType == "uchar" ? 256 : 65536;
+}
+
+template<typename T>
+BrickStats compute_stats(const T *data, const size_t count, const size_t nkeys) {
+  const size_t nblocks = std::max(size_t(1),
+      std::min(count / MIN_STATS_BLOCK_SIZE, MAX_STATS_BLOCKS));
+  const size_t blockSize = (count + nblocks - 1) / nblocks;
+  std::vector<T> blockMin(nblocks, std::numeric_limits<T>::max());
+  std::vector<T> blockMax(nblocks, std::numeric_limits<T>::lowest());
+  std::vector<std::vector<uint32_t>> blockCounts(nblocks);
+
+  tasking::parallel_for(nblocks, [&](const size_t b) {
+    const T *begin = data + std::min(count, b * blockSize);
+    const T *end = data + std::min(count, (b + 1) * blockSize);
+    T lo = blockMin[b];
+    T hi = blockMax[b];
+    std::vector<uint32_t> &counts = blockCounts[b];
+    counts.resize(nkeys, 0);
+    // Keep the min/max free of the histogram's scattered writes so the
+    // compiler can vectorize it
+    for (const T *x = begin; x != end; ++x) {
+      lo = *x < lo ? *x : lo;
+      hi = *x > hi ? *x : hi;
+    }
+    for (const T *x = begin; x != end; ++x) {
+      ++counts[histogram_key(*x)];
+    }
+    blockMin[b] = lo;
+    blockMax[b] = hi;
+  });
+
+  BrickStats stats;
+  stats.keyCounts.resize(nkeys, 0);
+  if (count == 0) {
+    return stats;
+  }
+  stats.range.x = static_cast<float>(*std::min_element(blockMin.begin(), blockMin.end()));
+  stats.range.y = static_cast<float>(*std::max_element(blockMax.begin(), blockMax.end()));
+  for (const auto &counts : blockCounts) {
+    for (size_t i = 0; i < nkeys; ++i) {
+      stats.keyCounts[i] += counts[i];
+    }
+  }
+  return stats;
+}
+
+BrickStats compute_brick_stats(const char *data, const size_t count,
+    const std::string &voxelType)
+{
+  const size_t nkeys = histogram_key_count(voxelType);
+  if (voxelType == "uchar") {
+    return compute_stats(reinterpret_cast<const uint8_t*>(data), count, nkeys);
+  } else if (voxelType == "short") {
+    return compute_stats(reinterpret_cast<const int16_t*>(data), count, nkeys);
+  } else if (voxelType == "ushort") {
+    return compute_stats(reinterpret_cast<const uint16_t*>(data), count, nkeys);
+  } else if (voxelType == "float") {
+    return compute_stats(reinterpret_cast<const float*>(data), count, nkeys);
+  } else if (voxelType == "double") {
+    return compute_stats(reinterpret_cast<const double*>(data), count, nkeys);
+  }
+  throw std::runtime_error("Unsupported voxel type " + voxelType);
+}
+
+std::vector<uint64_t> bin_histogram(const std::vector<uint64_t> &keyCounts,
+    const std::string &voxelType, const vec2f &range, const size_t nbins)
+{
+  std::vector<uint64_t> bins(nbins, 0);
+  const float width = range.y - range.x;
+  for (size_t k = 0; k < keyCounts.size(); ++k) {
+    if (keyCounts[k] == 0) {
+      continue;
+    }
+    const float x = histogram_key_value(k, voxelType);
+    const float t = width > 0.f ? (x - range.x) / width : 0.f;
+    const size_t b = static_cast<size_t>(std::max(0.f, std::min(t * nbins, float(nbins - 1))));
+    bins[b] += keyCounts[k];
+  }
+  return bins;
+}
+
+
+MacrocellGrid::MacrocellGrid() : cellSize(MACROCELL_SIZE), dims(0) {}
+
+template<typename T>
+void compute_cell_ranges(const T *data, const vec3sz &dims, MacrocellGrid &grid) {
+  const size_t numCells = grid.dims.x * grid.dims.y * grid.dims.z;
+  tasking::parallel_for(numCells, [&](const size_t c) {
+    const vec3sz cell(c % grid.dims.x, (c / grid.dims.x) % grid.dims.y,
+        c / (grid.dims.x * grid.dims.y));
+    const vec3sz lo = cell * grid.cellSize;
+    const vec3sz hi = ospcommon::min(lo + vec3sz(grid.cellSize), dims - vec3sz(1));
+    T cellMin = std::numeric_limits<T>::max();
+    T cellMax = std::numeric_limits<T>::lowest();
+    for (size_t z = lo.z; z <= hi.z; ++z) {
+      for (size_t y = lo.y; y <= hi.y; ++y) {
+        const T *row = data + (z * dims.y + y) * dims.x;
+        for (size_t x = lo.x; x <= hi.x; ++x) {
+          cellMin = row[x] < cellMin ? row[x] : cellMin;
+          cellMax = row[x] > cellMax ? row[x] : cellMax;
+        }
+      }
+    }
+    grid.ranges[c] = vec2f(cellMin, cellMax);
+  });
+}
+
+MacrocellGrid compute_macrocells(const char *data, const vec3sz &dims,
+    const std::string &voxelType, const size_t cellSize)
+{
+  MacrocellGrid grid;
+  grid.cellSize = cellSize;
+  if (dims.x == 0 || dims.y == 0 || dims.z == 0) {
+    return grid;
+  }
+  // The last voxel along each axis is shared with the previous cell, so it
+  // doesn't start a cell of its own
+  for (size_t i = 0; i < 3; ++i) {
+    grid.dims[i] = std::max(size_t(1), (dims[i] - 1 + cellSize - 1) / cellSize);
+  }
+  grid.ranges.resize(grid.dims.x * grid.dims.y * grid.dims.z);
+
+  if (voxelType == "uchar") {
+    compute_cell_ranges(reinterpret_cast<const uint8_t*>(data), dims, grid);
+  } else if (voxelType == "short") {
+    compute_cell_ranges(reinterpret_cast<const int16_t*>(data), dims, grid);
+  } else if (voxelType == "ushort") {
+    compute_cell_ranges(reinterpret_cast<const uint16_t*>(data), dims, grid);
+  } else if (voxelType == "float") {
+    compute_cell_ranges(reinterpret_cast<const float*>(data), dims, grid);
+  } else if (voxelType == "double") {
+    compute_cell_ranges(reinterpret_cast<const double*>(data), dims, grid);
+  } else {
+    throw std::runtime_error("Unsupported voxel type " + voxelType);
+  }
+  return grid;
+}
+
+bool range_visible(const std::vector<float> &opacities, const vec2f &tfcnRange,
+    const vec2f &range)
+{
+  if (opacities.empty()) {
+    return true;
+  }
+  // Values outside the transfer function's range are clamped to its ends
+  const float last = opacities.size() - 1;
+  const float width = tfcnRange.y - tfcnRange.x;
+  size_t lo = 0;
+  size_t hi = opacities.size() - 1;
+  if (width > 0.f) {
+    const float tlo = (range.x - tfcnRange.x) / width;
+    const float thi = (range.y - tfcnRange.x) / width;
+    lo = static_cast<size_t>(std::floor(std::max(0.f, std::min(tlo * last, last))));
+    hi = static_cast<size_t>(std::ceil(std::max(0.f, std::min(thi * last, last))));
+  }
+  // Between samples the opacity is interpolated, so it's only zero over the
+  // range if every sample at or bracketing the range is zero
+  for (size_t i = lo; i <= hi; ++i) {
+    if (opacities[i] > 0.f) {
+      return true;
+    }
+  }
+  return false;
+}
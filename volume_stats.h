@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ospcommon/vec.h"
+#include "util.h"
+
+// The number of bins in the histograms we compute for bricks
+const size_t HISTOGRAM_BINS = 256;
+// The number of voxels along each axis of a brick's macrocells
+const size_t MACROCELL_SIZE = 16;
+
+/* The value range of a brick's voxels along with a histogram of the values,
+ * binned by the top bits of a key which sorts in the same order as the
+ * values. This lets us bin the values in the same pass as finding the range,
+ * and re-bin them later once we know the range over all the bricks.
+ */
+struct BrickStats {
+  ospcommon::vec2f range;
+  std::vector<uint64_t> keyCounts;
+};
+
+// Get the size in bytes of a voxel of the voxelType
+size_t voxel_size(const std::string &voxelType);
+
+/* Compute the value range and key histogram of the count voxels of the
+ * voxelType in data, in parallel.
+ */
+BrickStats compute_brick_stats(const char *data, const size_t count,
+    const std::string &voxelType);
+
+/* Bin the key histogram computed for the voxelType into nbins bins evenly
+ * spaced over the range.
+ */
+std::vector<uint64_t> bin_histogram(const std::vector<uint64_t> &keyCounts,
+    const std::string &voxelType, const ospcommon::vec2f &range,
+    const size_t nbins);
+
+/* A coarse grid over a brick storing the value range of each cell, used to
+ * skip the parts of the brick which are transparent under the transfer
+ * function. Cell i covers voxels i * cellSize up to and including
+ * (i + 1) * cellSize, so neighboring cells share a layer of voxels and each
+ * cell's range bounds the values interpolated anywhere inside it.
+ */
+struct MacrocellGrid {
+  size_t cellSize;
+  vec3sz dims;
+  // Row-major ranges of the cells
+  std::vector<ospcommon::vec2f> ranges;
+
+  MacrocellGrid();
+};
+
+/* Compute the macrocell grid of the brick of the voxelType with dims voxels,
+ * in parallel over the cells.
+ */
+MacrocellGrid compute_macrocells(const char *data, const vec3sz &dims,
+    const std::string &voxelType, const size_t cellSize = MACROCELL_SIZE);
+
+/* Check if any value in the range is given non-zero opacity by a piecewise
+ * linear transfer function with the opacities spaced evenly over tfcnRange.
+ * An empty opacity array is treated as everything being visible.
+ */
+bool range_visible(const std::vector<float> &opacities,
+    const ospcommon::vec2f &tfcnRange, const ospcommon::vec2f &range);
+